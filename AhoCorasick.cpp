@@ -0,0 +1,154 @@
+#include "AhoCorasick.h"
+#include <assert.h>
+#include <string.h>
+
+static const size_t None = static_cast<size_t>(-1);
+
+AhoCorasick::AhoCorasick()
+    : mClassCount(1)
+{
+    memset(mClasses, 0, sizeof(mClasses));
+}
+
+void AhoCorasick::add(const char *pattern, size_t length)
+{
+    assert(mTransitions.empty());
+    mPatterns.push_back(std::string(pattern, length));
+}
+
+void AhoCorasick::compile()
+{
+    // Bytes that don't occur in any pattern share class 0, which keeps the
+    // transition table at states * classes rather than states * 256.
+    for (std::vector<std::string>::const_iterator it = mPatterns.begin(); it != mPatterns.end(); ++it) {
+        for (std::string::const_iterator ch = it->begin(); ch != it->end(); ++ch) {
+            unsigned short &cls = mClasses[static_cast<unsigned char>(*ch)];
+            if (!cls)
+                cls = mClassCount++;
+        }
+    }
+
+    // Build the trie. 0 is the root and can never be a child, so it doubles
+    // as "no transition" until the failure links have been resolved.
+    mTransitions.assign(mClassCount, 0);
+    mOutput.assign(1, None);
+    for (size_t idx=0; idx<mPatterns.size(); ++idx) {
+        const std::string &pattern = mPatterns[idx];
+        unsigned int state = 0;
+        for (std::string::const_iterator ch = pattern.begin(); ch != pattern.end(); ++ch) {
+            const size_t cls = mClasses[static_cast<unsigned char>(*ch)];
+            if (!mTransitions[state * mClassCount + cls]) {
+                mTransitions[state * mClassCount + cls] = mOutput.size();
+                mTransitions.resize(mTransitions.size() + mClassCount, 0);
+                mOutput.push_back(None);
+            }
+            state = mTransitions[state * mClassCount + cls];
+        }
+        if (mOutput[state] == None)
+            mOutput[state] = idx;
+    }
+
+    // Breadth first, turn the trie into a DFA by following failure links
+    // for missing transitions. Each state's output is the lowest pattern
+    // index among itself and its suffixes.
+    std::vector<unsigned int> fail(mOutput.size(), 0);
+    std::vector<unsigned int> queue;
+    for (size_t cls=0; cls<mClassCount; ++cls) {
+        if (mTransitions[cls])
+            queue.push_back(mTransitions[cls]);
+    }
+    for (size_t i=0; i<queue.size(); ++i) {
+        const unsigned int state = queue[i];
+        const unsigned int failState = fail[state];
+        if (mOutput[failState] < mOutput[state])
+            mOutput[state] = mOutput[failState];
+        for (size_t cls=0; cls<mClassCount; ++cls) {
+            unsigned int &next = mTransitions[state * mClassCount + cls];
+            const unsigned int failNext = mTransitions[failState * mClassCount + cls];
+            if (next) {
+                fail[next] = failNext;
+                queue.push_back(next);
+            } else {
+                next = failNext;
+            }
+        }
+    }
+}
+
+// Layout: pattern count, class count, the class table, then the state count
+// followed by the transitions and outputs of each state.
+template <typename T>
+static void append(std::string &out, const T *data, size_t count)
+{
+    out.append(reinterpret_cast<const char *>(data), count * sizeof(T));
+}
+
+template <typename T>
+static bool take(const char *&data, const char *end, T *out, size_t count)
+{
+    if (static_cast<size_t>(end - data) / sizeof(T) < count)
+        return false;
+    memcpy(out, data, count * sizeof(T));
+    data += count * sizeof(T);
+    return true;
+}
+
+void AhoCorasick::save(std::string &out) const
+{
+    assert(!mTransitions.empty());
+    const unsigned long long header[] = { mPatterns.size(), mClassCount, mOutput.size() };
+    append(out, header, 3);
+    append(out, mClasses, 256);
+    append(out, &mTransitions[0], mTransitions.size());
+    append(out, &mOutput[0], mOutput.size());
+}
+
+bool AhoCorasick::load(const char *data, size_t length)
+{
+    assert(mTransitions.empty());
+    const char *end = data + length;
+    unsigned long long header[3];
+    if (!take(data, end, header, 3) || header[0] != mPatterns.size() || !header[1] || header[1] > 257
+        || !header[2] || !take(data, end, mClasses, 256)) {
+        memset(mClasses, 0, sizeof(mClasses));
+        return false;
+    }
+    const size_t classes = header[1], states = header[2];
+    const size_t left = end - data, stateBytes = classes * sizeof(unsigned int) + sizeof(size_t);
+    bool ok = states <= left / stateBytes && left == states * stateBytes;
+    for (size_t i=0; ok && i<256; ++i)
+        ok = mClasses[i] < classes;
+    if (ok) {
+        mTransitions.resize(states * classes);
+        mOutput.resize(states);
+        take(data, end, &mTransitions[0], mTransitions.size());
+        take(data, end, &mOutput[0], mOutput.size());
+        for (std::vector<unsigned int>::const_iterator it = mTransitions.begin(); ok && it != mTransitions.end(); ++it)
+            ok = *it < states;
+        for (std::vector<size_t>::const_iterator it = mOutput.begin(); ok && it != mOutput.end(); ++it)
+            ok = *it == None || *it < mPatterns.size();
+    }
+    if (!ok) {
+        memset(mClasses, 0, sizeof(mClasses));
+        mTransitions.clear();
+        mOutput.clear();
+        return false;
+    }
+    mClassCount = classes;
+    return true;
+}
+
+size_t AhoCorasick::match(const char *data, size_t length, size_t limit) const
+{
+    assert(!mTransitions.empty());
+    size_t best = mOutput[0] < limit ? mOutput[0] : limit;
+    const unsigned char *ch = reinterpret_cast<const unsigned char *>(data);
+    const unsigned char *end = ch + length;
+    unsigned int state = 0;
+    while (best && ch < end) {
+        state = mTransitions[state * mClassCount + mClasses[*ch++]];
+        if (mOutput[state] < best)
+            best = mOutput[state];
+    }
+    return best;
+}
@@ -0,0 +1,40 @@
+#ifndef AhoCorasick_h
+#define AhoCorasick_h
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+// Multi-pattern literal matcher. All patterns are compiled into a single
+// deterministic automaton over byte classes so a line is scanned once,
+// regardless of how many patterns there are. Patterns are identified by the
+// order they were added in.
+class AhoCorasick
+{
+public:
+    AhoCorasick();
+
+    void add(const char *pattern, size_t length);
+    void compile();
+
+    // The compiled automaton as bytes, and back. load() is used instead of
+    // compile() after adding the same patterns and fails if what it's given
+    // doesn't fit them.
+    void save(std::string &out) const;
+    bool load(const char *data, size_t length);
+
+    // Returns the lowest index of a pattern that occurs in data, or limit if
+    // no pattern with an index lower than limit does.
+    size_t match(const char *data, size_t length, size_t limit) const;
+
+    size_t size() const { return mPatterns.size(); }
+
+private:
+    std::vector<std::string> mPatterns;
+    unsigned short mClasses[256];
+    size_t mClassCount;
+    std::vector<unsigned int> mTransitions;
+    std::vector<size_t> mOutput;
+};
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef BlockSource_h
+#define BlockSource_h
+
+#include <stddef.h>
+
+// Input that arrives in blocks with no regard for line boundaries
+class BlockSource
+{
+public:
+    virtual ~BlockSource()
+    {}
+
+    // The next block, valid until the next call. Returns false at the end.
+    virtual bool next(const char *&data, size_t &length) = 0;
+};
+
+#endif
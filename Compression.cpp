@@ -0,0 +1,569 @@
+#include "Compression.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+enum {
+    BlockSize = 1024 * 1024,
+    BlockCount = 4,
+    // zlib counts in unsigned ints, so memory is handed to it in pieces
+    InputSize = 256 * 1024
+};
+
+Compression detectCompression(const char *data, size_t length)
+{
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    if (length >= 2 && bytes[0] == 0x1f && bytes[1] == 0x8b)
+        return Gzip;
+    if (length >= 4 && bytes[0] == 0x28 && bytes[1] == 0xb5 && bytes[2] == 0x2f && bytes[3] == 0xfd)
+        return Zstd;
+    return Uncompressed;
+}
+
+bool compressionSupported(Compression compression)
+{
+    switch (compression) {
+    case Uncompressed:
+        return true;
+    case Gzip:
+#ifdef HAVE_ZLIB
+        return true;
+#else
+        return false;
+#endif
+    case Zstd:
+#ifdef HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+const char *compressionName(Compression compression)
+{
+    switch (compression) {
+    case Uncompressed:
+        break;
+    case Gzip:
+        return "gzip";
+    case Zstd:
+        return "zstd";
+    }
+    return "none";
+}
+
+bool parseCompression(const char *name, Compression *compression)
+{
+    if (!strcmp(name, "gzip")) {
+        *compression = Gzip;
+    } else if (!strcmp(name, "zstd")) {
+        *compression = Zstd;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+struct Block
+{
+    Block()
+        : data(BlockSize), length(0)
+    {}
+
+    std::vector<char> data;
+    size_t length;
+};
+
+// Passes blocks from one thread to another. Either side can close it, the
+// producer when it's done and the consumer when it stops early.
+class BlockPipe
+{
+public:
+    BlockPipe()
+        : mClosed(false)
+    {
+        for (size_t i=0; i<BlockCount; ++i)
+            mFree.push_back(new Block);
+    }
+
+    ~BlockPipe()
+    {
+        for (std::deque<Block*>::const_iterator it = mFree.begin(); it != mFree.end(); ++it)
+            delete *it;
+        for (std::deque<Block*>::const_iterator it = mReady.begin(); it != mReady.end(); ++it)
+            delete *it;
+    }
+
+    // An empty block to fill, 0 once closed
+    Block *acquire()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (mFree.empty() && !mClosed)
+            mCondition.wait(lock);
+        if (mClosed)
+            return 0;
+        Block *block = mFree.front();
+        mFree.pop_front();
+        block->length = 0;
+        return block;
+    }
+
+    void push(Block *block)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mReady.push_back(block);
+        mCondition.notify_all();
+    }
+
+    // The next filled block, 0 once closed and drained
+    Block *pop()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (mReady.empty() && !mClosed)
+            mCondition.wait(lock);
+        if (mReady.empty())
+            return 0;
+        Block *block = mReady.front();
+        mReady.pop_front();
+        return block;
+    }
+
+    void release(Block *block)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mFree.push_back(block);
+        mCondition.notify_all();
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mClosed = true;
+        mCondition.notify_all();
+    }
+
+private:
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<Block*> mFree, mReady;
+    bool mClosed;
+};
+
+struct Decompressor::Data
+{
+    Data(Compression c, const char *data, size_t length, int f)
+        : compression(c), memory(data), memoryLength(length), fd(f), headDone(false), current(0)
+    {}
+
+    // The next piece of compressed input, false at the end
+    bool fetch(const char *&data, size_t &length)
+    {
+        if (!headDone) {
+            headDone = true;
+            if (!head.empty()) {
+                data = head.data();
+                length = head.size();
+                return true;
+            }
+        }
+        if (fd == -1) {
+            if (!memoryLength)
+                return false;
+            data = memory;
+            length = std::min<size_t>(memoryLength, InputSize);
+            memory += length;
+            memoryLength -= length;
+            return true;
+        }
+        input.resize(InputSize);
+        ssize_t r;
+        do {
+            r = read(fd, &input[0], input.size());
+        } while (r == -1 && errno == EINTR);
+        if (r <= 0) {
+            if (r == -1)
+                error = strerror(errno);
+            return false;
+        }
+        data = &input[0];
+        length = r;
+        return true;
+    }
+
+    // Hands block over when it's full and returns the next one, 0 if the
+    // reader has gone away
+    Block *filled(Block *block)
+    {
+        if (block->length < block->data.size())
+            return block;
+        pipe.push(block);
+        return pipe.acquire();
+    }
+
+    void finish(Block *block)
+    {
+        if (block) {
+            if (block->length) {
+                pipe.push(block);
+            } else {
+                pipe.release(block);
+            }
+        }
+        pipe.close();
+    }
+
+    void run()
+    {
+        switch (compression) {
+        case Uncompressed:
+            copy();
+            return;
+        case Gzip:
+            gunzip();
+            return;
+        case Zstd:
+            unzstd();
+            return;
+        }
+    }
+
+    void copy()
+    {
+        Block *block = pipe.acquire();
+        const char *in;
+        size_t inLength;
+        while (block && fetch(in, inLength)) {
+            while (block && inLength) {
+                const size_t length = std::min(inLength, block->data.size() - block->length);
+                memcpy(&block->data[block->length], in, length);
+                block->length += length;
+                in += length;
+                inLength -= length;
+                block = filled(block);
+            }
+        }
+        finish(block);
+    }
+
+    void gunzip()
+    {
+        Block *block = pipe.acquire();
+#ifdef HAVE_ZLIB
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        // 32 lets zlib take either a gzip or a zlib header
+        if (inflateInit2(&z, 15 + 32) != Z_OK) {
+            error = "Can't initialize zlib";
+            finish(block);
+            return;
+        }
+        const char *in;
+        size_t inLength;
+        bool ended = false, drained = true;
+        while (block) {
+            // Output left over from a full block comes before more input
+            if (!z.avail_in && drained) {
+                if (!fetch(in, inLength))
+                    break;
+                z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in));
+                z.avail_in = inLength;
+            }
+            if (ended) {
+                // Concatenated gzip members make one stream
+                if (inflateReset(&z) != Z_OK)
+                    break;
+                ended = false;
+            }
+            z.next_out = reinterpret_cast<Bytef *>(&block->data[block->length]);
+            z.avail_out = block->data.size() - block->length;
+            const int ret = inflate(&z, Z_NO_FLUSH);
+            drained = z.avail_out;
+            block->length = block->data.size() - z.avail_out;
+            if (ret == Z_STREAM_END) {
+                ended = true;
+                drained = true;
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                error = z.msg ? z.msg : "Invalid gzip data";
+                break;
+            }
+            block = filled(block);
+        }
+        if (block && !ended && error.empty())
+            error = "Unexpected end of gzip data";
+        inflateEnd(&z);
+#else
+        error = "Built without gzip support";
+#endif
+        finish(block);
+    }
+
+    void unzstd()
+    {
+        Block *block = pipe.acquire();
+#ifdef HAVE_ZSTD
+        ZSTD_DStream *stream = ZSTD_createDStream();
+        if (!stream || ZSTD_isError(ZSTD_initDStream(stream))) {
+            ZSTD_freeDStream(stream);
+            error = "Can't initialize zstd";
+            finish(block);
+            return;
+        }
+        const char *in;
+        size_t inLength;
+        ZSTD_inBuffer input = { 0, 0, 0 };
+        // Nonzero until a frame has been completely decoded and flushed
+        size_t hint = 1;
+        bool drained = true;
+        while (block) {
+            if (input.pos == input.size && drained) {
+                if (!fetch(in, inLength))
+                    break;
+                input.src = in;
+                input.size = inLength;
+                input.pos = 0;
+            }
+            ZSTD_outBuffer output = { &block->data[block->length], block->data.size() - block->length, 0 };
+            hint = ZSTD_decompressStream(stream, &output, &input);
+            if (ZSTD_isError(hint)) {
+                error = ZSTD_getErrorName(hint);
+                break;
+            }
+            drained = output.pos < output.size;
+            block->length += output.pos;
+            block = filled(block);
+        }
+        if (block && hint && error.empty())
+            error = "Unexpected end of zstd data";
+        ZSTD_freeDStream(stream);
+#else
+        error = "Built without zstd support";
+#endif
+        finish(block);
+    }
+
+    const Compression compression;
+    const char *memory;
+    size_t memoryLength;
+    int fd;
+    std::string head;
+    bool headDone;
+    std::vector<char> input;
+
+    BlockPipe pipe;
+    Block *current;
+    std::string error;
+    std::thread thread;
+};
+
+Decompressor::Decompressor(Compression compression, const char *data, size_t length)
+    : mData(new Data(compression, data, length, -1))
+{
+    mData->thread = std::thread(&Data::run, mData);
+}
+
+Decompressor::Decompressor(Compression compression, int fd, const char *head, size_t headLength)
+    : mData(new Data(compression, 0, 0, fd))
+{
+    mData->head.assign(head, headLength);
+    mData->thread = std::thread(&Data::run, mData);
+}
+
+Decompressor::~Decompressor()
+{
+    mData->pipe.close();
+    mData->thread.join();
+    if (mData->current)
+        mData->pipe.release(mData->current);
+    delete mData;
+}
+
+bool Decompressor::next(const char *&data, size_t &length)
+{
+    if (mData->current)
+        mData->pipe.release(mData->current);
+    mData->current = mData->pipe.pop();
+    if (!mData->current)
+        return false;
+    data = &mData->current->data[0];
+    length = mData->current->length;
+    return true;
+}
+
+const char *Decompressor::error() const
+{
+    return mData->error.empty() ? 0 : mData->error.c_str();
+}
+
+struct CompressedOutput::Data
+{
+    Data(Compression c, FdOutput &o)
+        : compression(c), output(o), current(0), finished(false), buffer(BlockSize)
+    {}
+
+    // Writes out what's been compressed so far
+    void emit(size_t length)
+    {
+        if (!length)
+            return;
+        output.write(&buffer[0], length, true);
+        output.flush();
+    }
+
+    void run()
+    {
+        switch (compression) {
+        case Uncompressed:
+            while (Block *block = pipe.pop()) {
+                output.write(&block->data[0], block->length, true);
+                output.flush();
+                pipe.release(block);
+            }
+            break;
+        case Gzip:
+            gzip();
+            break;
+        case Zstd:
+            zstd();
+            break;
+        }
+        output.flush();
+    }
+
+    void gzip()
+    {
+#ifdef HAVE_ZLIB
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        // 16 asks for a gzip header and trailer rather than a zlib one
+        if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            fprintf(stderr, "Can't initialize zlib\n");
+            drain();
+            return;
+        }
+        Block *block;
+        do {
+            block = pipe.pop();
+            z.next_in = block ? reinterpret_cast<Bytef *>(&block->data[0]) : 0;
+            z.avail_in = block ? block->length : 0;
+            const int flush = block ? Z_NO_FLUSH : Z_FINISH;
+            int ret;
+            do {
+                z.next_out = reinterpret_cast<Bytef *>(&buffer[0]);
+                z.avail_out = buffer.size();
+                ret = deflate(&z, flush);
+                emit(buffer.size() - z.avail_out);
+            } while (z.avail_in || (flush == Z_FINISH && ret != Z_STREAM_END));
+            if (block)
+                pipe.release(block);
+        } while (block);
+        deflateEnd(&z);
+#else
+        drain();
+#endif
+    }
+
+    void zstd()
+    {
+#ifdef HAVE_ZSTD
+        ZSTD_CCtx *context = ZSTD_createCCtx();
+        if (!context) {
+            fprintf(stderr, "Can't initialize zstd\n");
+            drain();
+            return;
+        }
+        ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, ZSTD_CLEVEL_DEFAULT);
+        Block *block;
+        do {
+            block = pipe.pop();
+            ZSTD_inBuffer input = { block ? &block->data[0] : 0, block ? block->length : 0, 0 };
+            const ZSTD_EndDirective mode = block ? ZSTD_e_continue : ZSTD_e_end;
+            size_t left;
+            do {
+                ZSTD_outBuffer out = { &buffer[0], buffer.size(), 0 };
+                left = ZSTD_compressStream2(context, &out, &input, mode);
+                if (ZSTD_isError(left)) {
+                    fprintf(stderr, "Can't compress output: %s\n", ZSTD_getErrorName(left));
+                    break;
+                }
+                emit(out.pos);
+            } while (block ? input.pos < input.size : left != 0);
+            if (block)
+                pipe.release(block);
+        } while (block);
+        ZSTD_freeCCtx(context);
+#else
+        drain();
+#endif
+    }
+
+    // Throws away the rest so the writer doesn't block forever
+    void drain()
+    {
+        while (Block *block = pipe.pop())
+            pipe.release(block);
+    }
+
+    const Compression compression;
+    FdOutput &output;
+    BlockPipe pipe;
+    Block *current;
+    bool finished;
+    std::vector<char> buffer;
+    std::thread thread;
+};
+
+CompressedOutput::CompressedOutput(Compression compression, FdOutput &output)
+    : mData(new Data(compression, output))
+{
+    mData->thread = std::thread(&Data::run, mData);
+}
+
+CompressedOutput::~CompressedOutput()
+{
+    finish();
+    delete mData;
+}
+
+void CompressedOutput::write(const char *data, size_t length, bool)
+{
+    while (length) {
+        if (!mData->current)
+            mData->current = mData->pipe.acquire();
+        Block *block = mData->current;
+        const size_t chunk = std::min(length, block->data.size() - block->length);
+        memcpy(&block->data[block->length], data, chunk);
+        block->length += chunk;
+        data += chunk;
+        length -= chunk;
+        if (block->length == block->data.size()) {
+            mData->pipe.push(block);
+            mData->current = 0;
+        }
+    }
+}
+
+void CompressedOutput::finish()
+{
+    if (mData->finished)
+        return;
+    mData->finished = true;
+    if (mData->current) {
+        mData->pipe.push(mData->current);
+        mData->current = 0;
+    }
+    mData->pipe.close();
+    mData->thread.join();
+}
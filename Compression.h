@@ -0,0 +1,64 @@
+#ifndef Compression_h
+#define Compression_h
+
+#include "BlockSource.h"
+#include "Hunk.h"
+#include <string>
+
+enum Compression {
+    Uncompressed,
+    Gzip,
+    Zstd
+};
+
+// Identifies compressed data by its magic bytes. Four bytes are enough.
+Compression detectCompression(const char *data, size_t length);
+bool compressionSupported(Compression compression);
+const char *compressionName(Compression compression);
+// "gzip" or "zstd", returns false for anything else
+bool parseCompression(const char *name, Compression *compression);
+
+// Decompresses on a thread of its own, a few blocks ahead of the reader.
+// Uncompressed input is passed through the same way.
+class Decompressor : public BlockSource
+{
+public:
+    // data has to stay valid until the decompressor is gone
+    Decompressor(Compression compression, const char *data, size_t length);
+    // head is what has already been read from fd
+    Decompressor(Compression compression, int fd, const char *head, size_t headLength);
+    virtual ~Decompressor();
+
+    virtual bool next(const char *&data, size_t &length);
+
+    // Why the input ended early, 0 if it didn't
+    const char *error() const;
+
+private:
+    Decompressor(const Decompressor &);
+    Decompressor &operator=(const Decompressor &);
+
+    struct Data;
+    Data *mData;
+};
+
+// Compresses everything written to it on a thread of its own and writes the
+// result to output. Nothing is complete until finish() has been called.
+class CompressedOutput : public Output
+{
+public:
+    CompressedOutput(Compression compression, FdOutput &output);
+    virtual ~CompressedOutput();
+
+    virtual void write(const char *data, size_t length, bool mapped);
+    void finish();
+
+private:
+    CompressedOutput(const CompressedOutput &);
+    CompressedOutput &operator=(const CompressedOutput &);
+
+    struct Data;
+    Data *mData;
+};
+
+#endif
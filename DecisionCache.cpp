@@ -0,0 +1,102 @@
+#include "DecisionCache.h"
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char CacheMagic[8] = { 'h', 'u', 'n', 'k', 'd', 'c', '0', '1' };
+
+DecisionCache::DecisionCache(uint64_t key)
+    : mKey(key)
+{
+}
+
+bool DecisionCache::load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return errno == ENOENT;
+    char magic[sizeof(CacheMagic)];
+    uint64_t key, count;
+    bool ok = fread(magic, sizeof(magic), 1, f) == 1 && !memcmp(magic, CacheMagic, sizeof(magic))
+        && fread(&key, sizeof(key), 1, f) == 1 && fread(&count, sizeof(count), 1, f) == 1;
+    // A count that doesn't fit what's left of the file is a cache that was
+    // cut short or overwritten, and as good as one for other patterns
+    struct stat st;
+    const long header = ftell(f);
+    if (ok && (fstat(fileno(f), &st) || header < 0 || st.st_size < header
+               || count != static_cast<uint64_t>(st.st_size - header) / sizeof(Entry)
+               || (st.st_size - header) % sizeof(Entry))) {
+        count = 0;
+        key = ~mKey;
+    }
+    if (ok && key == mKey) {
+        std::vector<Entry> entries(count);
+        ok = !count || fread(&entries[0], sizeof(Entry), count, f) == count;
+        if (ok) {
+            if (!std::is_sorted(entries.begin(), entries.end()))
+                std::sort(entries.begin(), entries.end());
+            mLoaded.swap(entries);
+            mUsed.reset(new std::atomic<bool>[mLoaded.size()]);
+            for (size_t i=0; i<mLoaded.size(); ++i)
+                mUsed[i] = false;
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+bool DecisionCache::save(const char *path) const
+{
+    std::vector<Entry> entries(mAdded);
+    for (size_t i=0; i<mLoaded.size(); ++i) {
+        if (mUsed[i].load(std::memory_order_relaxed))
+            entries.push_back(mLoaded[i]);
+    }
+    std::sort(entries.begin(), entries.end());
+    entries.erase(std::unique(entries.begin(), entries.end(), sameHash), entries.end());
+
+    // Written next to the real one and renamed over it, like the pattern
+    // cache
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, static_cast<int>(getpid())) >= static_cast<int>(sizeof(tmp)))
+        return false;
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return false;
+    const uint64_t count = entries.size();
+    bool ok = fwrite(CacheMagic, sizeof(CacheMagic), 1, f) == 1 && fwrite(&mKey, sizeof(mKey), 1, f) == 1
+        && fwrite(&count, sizeof(count), 1, f) == 1
+        && (entries.empty() || fwrite(&entries[0], sizeof(Entry), entries.size(), f) == entries.size());
+    ok = !fclose(f) && ok;
+    if (ok)
+        ok = !rename(tmp, path);
+    if (!ok)
+        unlink(tmp);
+    return ok;
+}
+
+bool DecisionCache::find(uint64_t hash, bool *keep, size_t *match) const
+{
+    Entry probe;
+    probe.hash = hash;
+    const std::vector<Entry>::const_iterator it = std::lower_bound(mLoaded.begin(), mLoaded.end(), probe);
+    if (it == mLoaded.end() || it->hash != hash)
+        return false;
+    mUsed[it - mLoaded.begin()].store(true, std::memory_order_relaxed);
+    *keep = it->keep;
+    *match = it->match;
+    return true;
+}
+
+void DecisionCache::add(uint64_t hash, bool keep, size_t match)
+{
+    Entry entry;
+    entry.hash = hash;
+    entry.match = match;
+    entry.keep = keep;
+    std::lock_guard<std::mutex> lock(mMutex);
+    mAdded.push_back(entry);
+}
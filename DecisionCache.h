@@ -0,0 +1,54 @@
+#ifndef DecisionCache_h
+#define DecisionCache_h
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Remembers what was decided about hunks from one run to the next, keyed by
+// a hash of their bytes. The hashes are seeded with the pattern set's key,
+// so a file written for other patterns or flags is ignored. Lookups
+// only go to what was loaded and can be made from any thread, decisions
+// added during the run are kept aside until save().
+class DecisionCache
+{
+public:
+    DecisionCache(uint64_t key);
+
+    uint64_t key() const { return mKey; }
+
+    // A missing file is an empty cache, one that can't be read is reported
+    bool load(const char *path);
+    // Writes the decisions this run looked up or added, replacing the file
+    bool save(const char *path) const;
+
+    bool find(uint64_t hash, bool *keep, size_t *match) const;
+    void add(uint64_t hash, bool keep, size_t match);
+
+private:
+    DecisionCache(const DecisionCache &);
+    DecisionCache &operator=(const DecisionCache &);
+
+    struct Entry
+    {
+        uint64_t hash;
+        uint32_t match;
+        uint32_t keep;
+
+        bool operator<(const Entry &other) const { return hash < other.hash; }
+    };
+
+    static bool sameHash(const Entry &a, const Entry &b) { return a.hash == b.hash; }
+
+    const uint64_t mKey;
+    // Sorted by hash
+    std::vector<Entry> mLoaded;
+    std::unique_ptr<std::atomic<bool>[]> mUsed;
+    std::mutex mMutex;
+    std::vector<Entry> mAdded;
+};
+
+#endif
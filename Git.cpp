@@ -0,0 +1,285 @@
+#include "Git.h"
+#include <sys/wait.h>
+
+// Runs git with its stdout on a pipe that fd is set to. Literal makes git
+// take the pathspecs as they are, they're paths it has listed itself then.
+static pid_t spawnGit(const std::vector<std::string> &args, bool literal, int *fd)
+{
+    int fds[2];
+    if (pipe(fds) == -1)
+        return -1;
+    std::vector<char *> argv;
+    argv.push_back(const_cast<char *>("git"));
+    for (std::vector<std::string>::const_iterator it = args.begin(); it != args.end(); ++it)
+        argv.push_back(const_cast<char *>(it->c_str()));
+    argv.push_back(0);
+    const pid_t pid = fork();
+    if (!pid) {
+        close(fds[0]);
+        if (fds[1] != STDOUT_FILENO) {
+            dup2(fds[1], STDOUT_FILENO);
+            close(fds[1]);
+        }
+        if (literal)
+            setenv("GIT_LITERAL_PATHSPECS", "1", 1);
+        execvp("git", &argv[0]);
+        fprintf(stderr, "Can't run git: %s\n", strerror(errno));
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid == -1) {
+        close(fds[0]);
+        return -1;
+    }
+    *fd = fds[0];
+    return pid;
+}
+
+static bool waitGit(pid_t pid, std::string *error)
+{
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            if (error)
+                *error = strerror(errno);
+            return false;
+        }
+    }
+    if (WIFEXITED(status) && !WEXITSTATUS(status))
+        return true;
+    if (error) {
+        char buf[64];
+        if (WIFEXITED(status)) {
+            snprintf(buf, sizeof(buf), "git exited with status %d", WEXITSTATUS(status));
+        } else {
+            snprintf(buf, sizeof(buf), "git was killed by signal %d", WTERMSIG(status));
+        }
+        *error = buf;
+    }
+    return false;
+}
+
+// position is where git's output goes on from, as far as --index is
+// concerned, for when the diff is run in batches
+static bool runDiff(const std::vector<std::string> &args, bool literal, HunkHandler &handler,
+                    const FilterOptions &options, std::string *error, unsigned long long *position = 0)
+{
+    int fd;
+    const pid_t pid = spawnGit(args, literal, &fd);
+    if (pid == -1) {
+        if (error)
+            *error = strerror(errno);
+        return false;
+    }
+    std::string reason;
+    const bool ok = processFile(fd, handler, options, &reason, position);
+    close(fd);
+    if (!waitGit(pid, error))
+        return false;
+    if (!ok && error)
+        *error = reason;
+    return ok;
+}
+
+static bool readAll(const std::vector<std::string> &args, std::string &output, std::string *error)
+{
+    int fd;
+    const pid_t pid = spawnGit(args, false, &fd);
+    if (pid == -1) {
+        if (error)
+            *error = strerror(errno);
+        return false;
+    }
+    char buf[65536];
+    ssize_t r;
+    while ((r = read(fd, buf, sizeof(buf))) != 0) {
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            if (error)
+                *error = strerror(errno);
+            close(fd);
+            waitGit(pid, 0);
+            return false;
+        }
+        output.append(buf, r);
+    }
+    close(fd);
+    return waitGit(pid, error);
+}
+
+struct RawChange
+{
+    char status;
+    std::string from, to;
+};
+
+// Parses "git diff --raw -z", ":<modes> <ids> <status>\0<path>\0" with a
+// second path for renames and copies. Anything else, like the records of
+// a combined diff, fails it.
+static bool parseRaw(const std::string &raw, std::vector<RawChange> &changes)
+{
+    size_t pos = 0;
+    while (pos < raw.size()) {
+        const size_t end = raw.find('\0', pos);
+        if (raw[pos] != ':' || raw[pos + 1] == ':' || end == std::string::npos)
+            return false;
+        const size_t space = raw.rfind(' ', end);
+        if (space == std::string::npos || space < pos || space + 1 == end)
+            return false;
+        RawChange change;
+        change.status = raw[space + 1];
+        const bool twoPaths = change.status == 'R' || change.status == 'C';
+        size_t next = raw.find('\0', end + 1);
+        if (next == std::string::npos)
+            return false;
+        change.from.assign(raw, end + 1, next - end - 1);
+        if (twoPaths) {
+            const size_t start = next + 1;
+            next = raw.find('\0', start);
+            if (next == std::string::npos)
+                return false;
+            change.to.assign(raw, start, next - start);
+        } else {
+            change.to = change.from;
+        }
+        changes.push_back(change);
+        pos = next + 1;
+    }
+    return true;
+}
+
+// git prints these as they are in its headers. Other paths may be quoted or
+// followed by a tab.
+static bool plainPath(const std::string &path)
+{
+    for (std::string::const_iterator it = path.begin(); it != path.end(); ++it) {
+        const unsigned char ch = *it;
+        if (ch <= ' ' || ch >= 0x7f || ch == '"' || ch == '\\')
+            return false;
+    }
+    return !path.empty();
+}
+
+// Whether the file section git would print for change could be kept. Its
+// --files decision only rests on the "diff ", "--- " and "+++ " lines,
+// which follow from the paths, but the last two are left out for binary
+// files and pure renames so it has to be dropped both with and without them.
+static bool mightKeep(const RawChange &change, const FilterOptions &probe)
+{
+    if (!strchr("ADMRC", change.status) || !plainPath(change.from) || !plainPath(change.to))
+        return true;
+    const std::string diff = "diff --git a/" + change.from + " b/" + change.to + "\n";
+    const std::string oldPath = change.status == 'A' ? "--- /dev/null\n" : "--- a/" + change.from + "\n";
+    const std::string newPath = change.status == 'D' ? "+++ /dev/null\n" : "+++ b/" + change.to + "\n";
+    HunkArena section(0);
+    section.add(diff.c_str(), diff.size(), HunkArena::Matchable);
+    if (keepHunk(section, probe))
+        return true;
+    section.add(oldPath.c_str(), oldPath.size(), HunkArena::Matchable);
+    section.add(newPath.c_str(), newPath.size(), HunkArena::Matchable);
+    return keepHunk(section, probe);
+}
+
+bool processGit(char **args, int count, HunkHandler &handler, const FilterOptions &options, std::string *error)
+{
+    // Whatever the user's configuration says, the output has to be a plain
+    // diff to be split into hunks
+    std::vector<std::string> diffArgs;
+    diffArgs.push_back("diff");
+    diffArgs.push_back("--no-color");
+    diffArgs.push_back("--no-ext-diff");
+    // and have the headers the --files probes expect
+    diffArgs.push_back("--src-prefix=a/");
+    diffArgs.push_back("--dst-prefix=b/");
+    std::vector<std::string> revisions;
+    bool prefilter = options.flags & Files, ambiguous = false;
+    for (int i=0; i<count; ++i) {
+        if (!strcmp(args[i], "--")) {
+            ambiguous = false;
+            break;
+        }
+        // Without a "--" after it this could be a revision or a path, git
+        // tells them apart by looking at the work tree
+        if (args[i][0] != '-')
+            ambiguous = true;
+        // The headers git prints would no longer follow from the paths, or
+        // the paths it lists wouldn't be relative to the top level
+        if (strstr(args[i], "prefix") || !strncmp(args[i], "--relative", 10) || !strcmp(args[i], "--no-index"))
+            prefilter = false;
+        revisions.push_back(args[i]);
+    }
+    if (!prefilter || ambiguous) {
+        diffArgs.insert(diffArgs.end(), args, args + count);
+        return runDiff(diffArgs, false, handler, options, error);
+    }
+
+    std::vector<std::string> rawArgs;
+    rawArgs.push_back("diff");
+    rawArgs.push_back("--raw");
+    rawArgs.push_back("-z");
+    rawArgs.insert(rawArgs.end(), args, args + count);
+    std::string raw;
+    if (!readAll(rawArgs, raw, error))
+        return false;
+    std::vector<RawChange> changes;
+    if (!parseRaw(raw, changes)) {
+        diffArgs.insert(diffArgs.end(), args, args + count);
+        return runDiff(diffArgs, false, handler, options, error);
+    }
+
+    // The listed paths are relative to the top level, not to where we are,
+    // so that's where they are diffed from
+    std::vector<std::string> topArgs;
+    topArgs.push_back("rev-parse");
+    topArgs.push_back("--show-toplevel");
+    std::string top;
+    if (!readAll(topArgs, top, error))
+        return false;
+    if (!top.empty() && top[top.size() - 1] == '\n')
+        top.resize(top.size() - 1);
+    if (top.empty()) {
+        if (error)
+            *error = "git rev-parse --show-toplevel printed nothing";
+        return false;
+    }
+    diffArgs.insert(diffArgs.begin(), top);
+    diffArgs.insert(diffArgs.begin(), "-C");
+
+    // The probes shouldn't count as hunks or be remembered
+    const FilterOptions probe(options.matches, options.flags & ~Verbose);
+    diffArgs.insert(diffArgs.end(), revisions.begin(), revisions.end());
+    diffArgs.push_back("--");
+    const size_t fixed = diffArgs.size();
+
+    // The paths that are left are diffed a batch at a time to stay well
+    // below the argument limit. git prints them in the order it listed
+    // them in so the output is the same as one diff would have been,
+    // and --index counts on from one batch to the next.
+    enum { BatchBytes = 128 * 1024 };
+    size_t batchBytes = 0;
+    unsigned long long position = 0;
+    for (std::vector<RawChange>::const_iterator it = changes.begin(); it != changes.end(); ++it) {
+        if (!mightKeep(*it, probe)) {
+            if (options.flags & Verbose)
+                fprintf(stderr, "Skipping %s without diffing it\n", it->to.c_str());
+            continue;
+        }
+        // Both sides of a rename so git can pair them up again
+        diffArgs.push_back(it->from);
+        batchBytes += it->from.size() + 1;
+        if (it->to != it->from) {
+            diffArgs.push_back(it->to);
+            batchBytes += it->to.size() + 1;
+        }
+        if (batchBytes >= BatchBytes) {
+            if (!runDiff(diffArgs, true, handler, options, error, &position))
+                return false;
+            diffArgs.resize(fixed);
+            batchBytes = 0;
+        }
+    }
+    if (diffArgs.size() > fixed && !runDiff(diffArgs, true, handler, options, error, &position))
+        return false;
+    return true;
+}
@@ -0,0 +1,17 @@
+#ifndef Git_h
+#define Git_h
+
+#include "Hunk.h"
+#include <string>
+
+// Filters what "git diff args..." prints, reading it straight from git. With
+// --files the changed paths are listed with --raw first and only the ones
+// whose file section could be kept are diffed, so dropped files never get
+// their diff computed, from the top level of the work tree since that's
+// what the listed paths are relative to. Paths have to come after a "--"
+// in args for that, anything but options without one and git is just run
+// on args as they are.
+bool processGit(char **args, int count, HunkHandler &handler, const FilterOptions &options,
+                std::string *error = 0);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef Hash_h
+#define Hash_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// 64 bit FNV-1a. Used for cache keys and names, not for anything that has
+// to withstand deliberate collisions.
+static inline unsigned long long fnv1a(const void *data, size_t length,
+                                       unsigned long long hash = 0xcbf29ce484222325ULL)
+{
+    const unsigned char *ch = static_cast<const unsigned char *>(data);
+    for (size_t i=0; i<length; ++i) {
+        hash ^= ch[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// XXH64, for hashing whole hunks where FNV-1a would be too slow. Input is
+// read as little endian words, which is how the reference reads it on the
+// machines we run on.
+static inline uint64_t xxhRotate(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input)
+{
+    acc += input * 0xC2B2AE3D27D4EB4FULL;
+    return xxhRotate(acc, 31) * 0x9E3779B185EBCA87ULL;
+}
+
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t value)
+{
+    acc ^= xxhRound(0, value);
+    return acc * 0x9E3779B185EBCA87ULL + 0x85EBCA77C2B2AE63ULL;
+}
+
+static inline uint64_t xxh64(const void *data, size_t length, uint64_t seed = 0)
+{
+    static const uint64_t Prime1 = 0x9E3779B185EBCA87ULL, Prime2 = 0xC2B2AE3D27D4EB4FULL,
+        Prime3 = 0x165667B19E3779F9ULL, Prime4 = 0x85EBCA77C2B2AE63ULL, Prime5 = 0x27D4EB2F165667C5ULL;
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    const unsigned char *const end = p + length;
+    uint64_t hash;
+    if (length >= 32) {
+        uint64_t v1 = seed + Prime1 + Prime2, v2 = seed + Prime2, v3 = seed, v4 = seed - Prime1;
+        uint64_t words[4];
+        do {
+            memcpy(words, p, sizeof(words));
+            v1 = xxhRound(v1, words[0]);
+            v2 = xxhRound(v2, words[1]);
+            v3 = xxhRound(v3, words[2]);
+            v4 = xxhRound(v4, words[3]);
+            p += 32;
+        } while (end - p >= 32);
+        hash = xxhRotate(v1, 1) + xxhRotate(v2, 7) + xxhRotate(v3, 12) + xxhRotate(v4, 18);
+        hash = xxhMerge(hash, v1);
+        hash = xxhMerge(hash, v2);
+        hash = xxhMerge(hash, v3);
+        hash = xxhMerge(hash, v4);
+    } else {
+        hash = seed + Prime5;
+    }
+    hash += length;
+    while (end - p >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        hash ^= xxhRound(0, word);
+        hash = xxhRotate(hash, 27) * Prime1 + Prime4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        hash ^= word * Prime1;
+        hash = xxhRotate(hash, 23) * Prime2 + Prime3;
+        p += 4;
+    }
+    while (p < end) {
+        hash ^= *p++ * Prime5;
+        hash = xxhRotate(hash, 11) * Prime1;
+    }
+    hash ^= hash >> 33;
+    hash *= Prime2;
+    hash ^= hash >> 29;
+    hash *= Prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+#endif
@@ -0,0 +1,445 @@
+#include "Hunk.h"
+#include "Compression.h"
+#include "ReadAhead.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Parses a byte count with an optional k, m or g suffix.
+bool parseSize(const char *arg, size_t *size)
+{
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (end == arg)
+        return false;
+    switch (*end) {
+    case 'g':
+    case 'G':
+        value *= 1024;
+        // fall through
+    case 'm':
+    case 'M':
+        value *= 1024;
+        // fall through
+    case 'k':
+    case 'K':
+        value *= 1024;
+        ++end;
+        break;
+    }
+    if (*end)
+        return false;
+    *size = value;
+    return true;
+}
+
+template <int E>
+static HunkDecider selectVerbosity(unsigned int flags)
+{
+    return flags & Verbose ? &decideHunk<E, true> : &decideHunk<E, false>;
+}
+
+HunkDecider selectDecider(const MatchSet &matches, unsigned int flags)
+{
+    switch (matches.engine()) {
+    case MatchSet::Automaton:
+        return selectVerbosity<MatchSet::Automaton>(flags);
+    case MatchSet::Prefiltered:
+        return selectVerbosity<MatchSet::Prefiltered>(flags);
+    case MatchSet::Regexps:
+        return selectVerbosity<MatchSet::Regexps>(flags);
+    case MatchSet::Dynamic:
+        break;
+    }
+    return selectVerbosity<MatchSet::Dynamic>(flags);
+}
+
+ParallelFilter::ParallelFilter(const FilterOptions &options, size_t jobs, Output &output)
+    : mOptions(options), mOutput(output), mMaxBatches(jobs * 4), mBatchCount(0),
+      mCurrent(0), mStop(false)
+{
+    for (size_t i=0; i<jobs; ++i)
+        mWorkers.push_back(std::thread(&ParallelFilter::work, this));
+    mWriter = std::thread(&ParallelFilter::write, this);
+}
+
+ParallelFilter::~ParallelFilter()
+{
+    sync();
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mWorkCondition.notify_all();
+    mWriteCondition.notify_all();
+    for (std::vector<std::thread>::iterator it = mWorkers.begin(); it != mWorkers.end(); ++it)
+        it->join();
+    mWriter.join();
+    for (std::vector<Batch*>::const_iterator it = mFree.begin(); it != mFree.end(); ++it)
+        delete *it;
+}
+
+void ParallelFilter::hunk(HunkArena &lines)
+{
+    if (!mCurrent)
+        mCurrent = takeBatch();
+    if (mCurrent->count == mCurrent->hunks.size())
+        mCurrent->hunks.push_back(HunkArena(0));
+    mCurrent->lines += lines.size();
+    mCurrent->hunks[mCurrent->count++].swap(lines);
+    if (mCurrent->lines >= BatchLines)
+        dispatch();
+}
+
+void ParallelFilter::sync()
+{
+    if (mCurrent)
+        dispatch();
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (!mOrder.empty())
+        mFreeCondition.wait(lock);
+    mOutput.sync();
+}
+
+ParallelFilter::Batch *ParallelFilter::takeBatch()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mFree.empty() && mBatchCount == mMaxBatches)
+        mFreeCondition.wait(lock);
+    if (mFree.empty()) {
+        ++mBatchCount;
+        return new Batch;
+    }
+    Batch *batch = mFree.back();
+    mFree.pop_back();
+    return batch;
+}
+
+void ParallelFilter::dispatch()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQueue.push_back(mCurrent);
+        mOrder.push_back(mCurrent);
+    }
+    mCurrent = 0;
+    mWorkCondition.notify_one();
+}
+
+void ParallelFilter::work()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+        while (mQueue.empty() && !mStop)
+            mWorkCondition.wait(lock);
+        if (mQueue.empty())
+            return;
+        Batch *batch = mQueue.front();
+        mQueue.pop_front();
+        lock.unlock();
+        batch->keep.resize(batch->count);
+        batch->match.resize(batch->count);
+        for (size_t i=0; i<batch->count; ++i)
+            batch->keep[i] = keepHunk(batch->hunks[i], mOptions, &batch->match[i]);
+        lock.lock();
+        batch->done = true;
+        if (batch == mOrder.front())
+            mWriteCondition.notify_one();
+    }
+}
+
+void ParallelFilter::write()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+        while ((mOrder.empty() || !mOrder.front()->done) && !mStop)
+            mWriteCondition.wait(lock);
+        if (mOrder.empty())
+            return;
+        Batch *batch = mOrder.front();
+        lock.unlock();
+        for (size_t i=0; i<batch->count; ++i) {
+            const HunkArena &hunk = batch->hunks[i];
+            mOutput.decided(hunk.position(), hunk.bytes(), batch->keep[i], batch->match[i]);
+            if (batch->keep[i]) {
+                mOutput.route(batch->match[i]);
+                writeHunk(hunk, mOutput);
+            }
+        }
+        batch->count = batch->lines = 0;
+        batch->done = false;
+        lock.lock();
+        mOrder.pop_front();
+        mFree.push_back(batch);
+        mFreeCondition.notify_all();
+    }
+}
+
+// Lines are split out of each block in place. Only a line that straddles
+// blocks is put together in carry, which keeps its capacity from one such
+// line to the next, so lines of any length are read whole.
+bool processBlocks(BlockSource &source, HunkHandler &handler, const FilterOptions &options, std::string *error,
+                   unsigned long long *position)
+{
+    HunkSplitter splitter(0, handler, options, position ? *position : 0);
+    std::vector<LineRecord> records;
+    std::string carry;
+    unsigned long long elapsed = 0, bytes = 0;
+    while (true) {
+        const unsigned long long start = options.stats ? Stats::now() : 0;
+        const char *data;
+        size_t length;
+        if (!source.next(data, length))
+            break;
+        size_t pos = 0;
+        if (!carry.empty()) {
+            const char *nl = static_cast<const char *>(memchr(data, '\n', length));
+            if (!nl) {
+                carry.append(data, length);
+                continue;
+            }
+            pos = nl - data + 1;
+            carry.append(data, pos);
+            splitter.line(carry.data(), carry.size(), classifyLine(carry.data(), carry.size()));
+            carry.clear();
+        }
+        records.clear();
+        const size_t consumed = scanLines(data + pos, length - pos, false, records);
+        if (options.stats) {
+            elapsed += Stats::now() - start;
+            bytes += length;
+        }
+        for (size_t i=0; i + 1<records.size(); ++i) {
+            splitter.line(data + pos + records[i].offset, records[i + 1].offset - records[i].offset,
+                          records[i].kind);
+        }
+        carry.assign(data + pos + consumed, length - pos - consumed);
+    }
+    if (!carry.empty())
+        splitter.line(carry.data(), carry.size(), classifyLine(carry.data(), carry.size()));
+    splitter.finish();
+    if (position)
+        *position = splitter.position();
+    if (options.stats) {
+        options.stats->read(bytes);
+        options.stats->add(Stats::Read, elapsed);
+    }
+    if (!splitter.error().empty()) {
+        if (error)
+            *error = splitter.error();
+        return false;
+    }
+    return true;
+}
+
+static ssize_t readBlock(int fd, char *data, size_t length)
+{
+    ssize_t r;
+    do {
+        r = read(fd, data, length);
+    } while (r == -1 && errno == EINTR);
+    return r;
+}
+
+bool processFile(int fd, HunkHandler &handler, const FilterOptions &options, std::string *error,
+                 unsigned long long *position)
+{
+    // The first block tells whether the stream is compressed. A pipe may
+    // hand out less than the magic bytes at first.
+    enum { BlockSize = 1024 * 1024, MagicSize = 4 };
+    std::vector<char> buffer(BlockSize);
+    size_t length = 0;
+    while (length < MagicSize) {
+        const ssize_t r = readBlock(fd, &buffer[length], buffer.size() - length);
+        if (r == -1) {
+            if (error)
+                *error = strerror(errno);
+            return false;
+        }
+        if (!r)
+            break;
+        length += r;
+    }
+    const Compression compression = detectCompression(&buffer[0], length);
+    if (compression != Uncompressed) {
+        Decompressor decompressor(compression, fd, &buffer[0], length);
+        const bool ok = processBlocks(decompressor, handler, options, error, position);
+        if (decompressor.error()) {
+            if (error)
+                *error = decompressor.error();
+            return false;
+        }
+        return ok;
+    }
+    // The next blocks are read while this one is parsed
+    ReadAhead source(fd, &buffer[0], length);
+    const bool ok = processBlocks(source, handler, options, error, position);
+    if (source.error()) {
+        if (error)
+            *error = source.error();
+        return false;
+    }
+    return ok;
+}
+
+void processFile(const char *data, size_t size, HunkHandler &handler, const FilterOptions &options)
+{
+    // The mapping is scanned one window at a time to keep the record table
+    // small. A window without a newline is retried at twice the size.
+    enum { ScanWindow = 256 * 1024 };
+    HunkSplitter splitter(data, handler, options);
+    std::vector<LineRecord> records;
+    size_t pos = 0, window = ScanWindow;
+    while (pos < size) {
+        const size_t length = std::min<size_t>(window, size - pos);
+        records.clear();
+        const unsigned long long start = options.stats ? Stats::now() : 0;
+        const size_t consumed = scanLines(data + pos, length, pos + length == size, records);
+        if (options.stats)
+            options.stats->time(Stats::Read, start);
+        if (!consumed) {
+            window *= 2;
+            continue;
+        }
+        size_t next = pos + consumed;
+        for (size_t i=0; i + 1<records.size(); ++i) {
+            splitter.line(data + pos + records[i].offset, records[i + 1].offset - records[i].offset,
+                          records[i].kind);
+            if (splitter.skipping()) {
+                // The rest of the section is dropped, go straight to
+                // where the next one starts
+                next = pos + records[i + 1].offset;
+                const size_t skip = skipHunks(data + next, size - next);
+                splitter.skipped(skip);
+                next += skip;
+                break;
+            }
+        }
+        pos = next;
+        window = ScanWindow;
+    }
+    splitter.finish();
+    handler.sync();
+    if (options.stats)
+        options.stats->read(size);
+}
+
+// Regular files are mapped and scanned in place, anything else (pipes,
+// devices, empty files) goes through the streaming path. Compressed files
+// are mapped too and decompressed straight from the mapping.
+bool processPath(const char *path, HunkHandler &handler, const FilterOptions &options, std::string *error)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (error)
+            *error = std::string("Can't open ") + path + " for reading";
+        return false;
+    }
+    std::string reason;
+    struct stat st;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *mapped = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            close(fd);
+            madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+            const char *data = static_cast<const char *>(mapped);
+            const Compression compression = detectCompression(data, st.st_size);
+            if (compression == Uncompressed) {
+                processFile(data, st.st_size, handler, options);
+            } else {
+                Decompressor decompressor(compression, data, st.st_size);
+                processBlocks(decompressor, handler, options, &reason);
+                if (decompressor.error())
+                    reason = decompressor.error();
+            }
+            munmap(mapped, st.st_size);
+            if (!reason.empty()) {
+                if (error)
+                    *error = std::string("Can't read ") + path + ": " + reason;
+                return false;
+            }
+            return true;
+        }
+    }
+    const bool ok = processFile(fd, handler, options, &reason);
+    close(fd);
+    if (!ok && error)
+        *error = std::string("Can't read ") + path + ": " + reason;
+    return ok;
+}
+
+// Filters several files at the same time, each into its own buffer, and
+// writes the buffers in argument order. Like the serial path it stops at the
+// first file that can't be read, after writing everything before it.
+bool processPaths(char **paths, size_t count, const FilterOptions &options, size_t jobs,
+                         Output &output)
+{
+    struct Job
+    {
+        Job()
+            : ok(false), done(false)
+        {}
+
+        BufferOutput output;
+        std::string error;
+        bool ok, done;
+    };
+    std::vector<Job> results(count);
+    std::mutex mutex;
+    std::condition_variable condition;
+    size_t next = 0, written = 0;
+    bool stop = false;
+
+    // Workers stay at most a few files ahead of the writer so buffered
+    // output doesn't grow without bound.
+    const size_t window = jobs * 4;
+    std::vector<std::thread> workers;
+    for (size_t i=0; i<jobs; ++i) {
+        workers.push_back(std::thread([&]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                while (!stop && next < count && next >= written + window)
+                    condition.wait(lock);
+                if (stop || next == count)
+                    return;
+                Job &job = results[next];
+                const char *path = paths[next++];
+                lock.unlock();
+                IndexOutput index(job.output, options.flags & TextIndex, options.matches.size(), next - 1);
+                Output &output = options.flags & Index ? static_cast<Output &>(index) : job.output;
+                SerialFilter filter(options, output);
+                job.ok = processPath(path, filter, options, &job.error);
+                lock.lock();
+                job.done = true;
+                condition.notify_all();
+            }
+        }));
+    }
+
+    bool ok = true;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (written < count) {
+        Job &job = results[written];
+        while (!job.done)
+            condition.wait(lock);
+        lock.unlock();
+        if (!job.ok) {
+            fprintf(stderr, "%s\n", job.error.c_str());
+            ok = false;
+        } else {
+            output.write(job.output.buffer().data(), job.output.buffer().size(), false);
+            std::string().swap(job.output.buffer());
+        }
+        lock.lock();
+        if (!ok)
+            break;
+        ++written;
+        condition.notify_all();
+    }
+    stop = true;
+    condition.notify_all();
+    lock.unlock();
+    for (std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); ++it)
+        it->join();
+    return ok;
+}
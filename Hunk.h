@@ -0,0 +1,1271 @@
+#ifndef Hunk_h
+#define Hunk_h
+
+#include "AhoCorasick.h"
+#include "BlockSource.h"
+#include "DecisionCache.h"
+#include "Hash.h"
+#include "LineCache.h"
+#include "LineScanner.h"
+#include "Predicates.h"
+#include "RegexSet.h"
+#include "Stats.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <limits.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+enum Flag {
+    MatchContext = 0x1,
+    MatchHeaders = 0x2,
+    Raw = 0x4,
+    Verbose = 0x8,
+    Files = 0x10,
+    Index = 0x20, // Describe hunks instead of printing them
+    TextIndex = 0x40
+};
+
+class Match
+{
+public:
+    enum Type {
+        In,
+        Out
+    };
+
+    Match(Type t)
+        : type(t)
+    {}
+
+    virtual ~Match()
+    {}
+
+    virtual bool match(const char *line, size_t length) const = 0;
+    virtual std::string toString() const = 0;
+
+    const Type type;
+};
+
+class RawMatch final : public Match
+{
+public:
+    RawMatch(Type type, char *pattern)
+        : Match(type), mPattern(pattern), mLength(strlen(pattern))
+    {}
+
+    virtual bool match(const char *line, size_t length) const
+    {
+        return memmem(line, length, mPattern, mLength);
+    }
+
+    virtual std::string toString() const
+    {
+        char buf[1024];
+        snprintf(buf, sizeof(buf), "--%s=%s", type == In ? "in" : "out", mPattern);
+        return buf;
+    }
+
+    char *mPattern;
+    size_t mLength;
+};
+
+class RegexpMatch final : public Match
+{
+public:
+    // A lazy pattern is known to be valid, from the pattern cache, and is
+    // only compiled if it ever has to be matched on its own.
+    RegexpMatch(Type type, char *pattern, bool lazy = false)
+        : Match(type), mPattern(pattern), mLiteral(requiredLiteral(pattern)), mValid(true), mCompiled(false)
+    {
+        if (!lazy)
+            compile();
+    }
+
+    ~RegexpMatch()
+    {
+        if (mCompiled && mValid)
+            regfree(&mRegex);
+    }
+
+    bool isValid() const { return mValid; }
+
+    virtual bool match(const char *line, size_t length) const
+    {
+        // Most lines don't contain the literal, memmem is a lot cheaper
+        // than regexec at telling
+        if (!mLiteral.empty() && !memmem(line, length, mLiteral.c_str(), mLiteral.size()))
+            return false;
+        compile();
+        if (!mValid)
+            return false;
+#ifdef REG_STARTEND
+        regmatch_t range;
+        range.rm_so = 0;
+        range.rm_eo = length;
+        return !regexec(&mRegex, line, 1, &range, REG_STARTEND);
+#else
+        const std::string copy(line, length);
+        return !regexec(&mRegex, copy.c_str(), 0, 0, 0);
+#endif
+    }
+
+    virtual std::string toString() const
+    {
+        char buf[1024];
+        snprintf(buf, sizeof(buf), "--%s=%s", type == In ? "in" : "out", mPattern);
+        return buf;
+    }
+
+    char *mPattern;
+    // Part of every match, empty if there's no such literal
+    const std::string mLiteral;
+
+private:
+    void compile() const
+    {
+        std::call_once(mOnce, &RegexpMatch::doCompile, this);
+    }
+
+    void doCompile() const
+    {
+        mValid = !regcomp(&mRegex, mPattern, 0);
+        mCompiled = true;
+    }
+
+    mutable regex_t mRegex;
+    mutable bool mValid, mCompiled;
+    mutable std::once_flag mOnce;
+};
+
+// All patterns in priority order. Raw patterns are compiled into a single
+// automaton and regexps into a RegexSet so each line is scanned once rather
+// than once per pattern. Regexps the set can't handle are matched with
+// regexec on their own.
+class MatchSet
+{
+public:
+    // How lines are matched, fixed once the set is built. Dynamic finds out
+    // on every call.
+    enum Engine {
+        Automaton, // Raw patterns
+        Prefiltered, // Regexps, skipped unless a literal matches
+        Regexps,
+        Dynamic
+    };
+
+    // compiled is what save() produced for the same patterns and flags, if
+    // it's there and usable it's loaded instead of compiling again. groups
+    // has the --group of each pattern, if they're split into groups.
+    MatchSet(const std::vector<Match*> &matches, unsigned int flags, const std::string *compiled = 0,
+             const std::vector<size_t> *groups = 0)
+        : mMatches(matches), mRaw(flags & Raw), mHasIns(false), mPrefilter(!mRaw)
+    {
+        for (std::vector<Match*>::const_iterator it = matches.begin(); it != matches.end(); ++it) {
+            if ((*it)->type == Match::In)
+                mHasIns = true;
+            // Once pattern m has matched only lower patterns can still
+            // match, so if those are all of the same type, and group, the
+            // outcome is settled.
+            const size_t idx = it - matches.begin();
+            mTypes.push_back((*it)->type);
+            mDecided.push_back(!idx || (mDecided.back() && mTypes[idx - 1] == (*it)->type
+                                        && (!groups || (*groups)[idx - 1] == (*groups)[idx])));
+            if (mRaw) {
+                const RawMatch *raw = static_cast<const RawMatch *>(*it);
+                mAutomaton.add(raw->mPattern, raw->mLength);
+            } else {
+                const RegexpMatch *regexp = static_cast<const RegexpMatch *>(*it);
+                if (!mRegexps.add(regexp->mPattern, it - matches.begin())) {
+                    mFallback.push_back(it - matches.begin());
+                } else if (regexp->mLiteral.empty()) {
+                    mPrefilter = false;
+                } else {
+                    mAutomaton.add(regexp->mLiteral.c_str(), regexp->mLiteral.size());
+                    mLiteralOwners.push_back(it - matches.begin());
+                }
+            }
+        }
+        if (mRaw) {
+            if (!compiled || !mAutomaton.load(compiled->c_str(), compiled->size()))
+                mAutomaton.compile();
+        } else {
+            // If every regexp in the set has a literal, the literals go in
+            // the automaton and lines that contain none of them skip the
+            // set.
+            mPrefilter = mPrefilter && !mLiteralOwners.empty();
+            if (!mRegexps.compile()) {
+                // Too many for the set, each is matched on its own
+                mFallback.clear();
+                for (size_t idx=0; idx<matches.size(); ++idx)
+                    mFallback.push_back(idx);
+                mPrefilter = false;
+            }
+            if (mPrefilter)
+                mAutomaton.compile();
+        }
+    }
+
+    // The RE2 set can't be serialized so only raw patterns have anything
+    // to save. For regexps a cache hit only saves checking that they're
+    // valid, the set is built again.
+    void save(std::string &out) const
+    {
+        if (mRaw)
+            mAutomaton.save(out);
+    }
+
+    Engine engine() const { return mRaw ? Automaton : mPrefilter ? Prefiltered : Regexps; }
+
+    // Returns the index of the first pattern that matches line, or limit if
+    // none of the patterns before limit do.
+    size_t match(const char *line, size_t length, size_t limit) const
+    {
+        return matchWith<Dynamic>(line, length, limit);
+    }
+
+    // match() with the engine known at compile time, E has to be Dynamic or
+    // engine()
+    template <int E>
+    size_t matchWith(const char *line, size_t length, size_t limit) const
+    {
+        if (E == Automaton || (E == Dynamic && mRaw))
+            return mAutomaton.match(line, length, limit);
+        size_t best = limit;
+        if (E == Prefiltered || (E == Dynamic && mPrefilter)) {
+            const size_t first = mAutomaton.match(line, length, mLiteralOwners.size());
+            if (first < mLiteralOwners.size() && mLiteralOwners[first] < limit
+                && !mRegexps.match(line, length, limit, &best)) {
+                return matchEach(line, length, limit);
+            }
+        } else if (!mRegexps.match(line, length, limit, &best)) {
+            return matchEach(line, length, limit);
+        }
+        for (std::vector<size_t>::const_iterator it = mFallback.begin(); it != mFallback.end() && *it < best; ++it) {
+            if (regexp(*it)->match(line, length))
+                return *it;
+        }
+        return best;
+    }
+
+    size_t size() const { return mMatches.size(); }
+    const Match *at(size_t idx) const { return mMatches[idx]; }
+    bool hasIns() const { return mHasIns; }
+    Match::Type type(size_t idx) const { return mTypes[idx]; }
+    bool decided(size_t idx) const { return mDecided[idx]; }
+
+private:
+    // Only regexps go through the set, so the calls can be made directly
+    const RegexpMatch *regexp(size_t idx) const { return static_cast<const RegexpMatch *>(mMatches[idx]); }
+
+    // For when the set gave up on a line
+    size_t matchEach(const char *line, size_t length, size_t limit) const
+    {
+        for (size_t m=0; m<limit; ++m) {
+            if (regexp(m)->match(line, length))
+                return m;
+        }
+        return limit;
+    }
+
+    const std::vector<Match*> &mMatches;
+    const bool mRaw;
+    bool mHasIns, mPrefilter;
+    std::vector<Match::Type> mTypes;
+    std::vector<bool> mDecided;
+    // The raw patterns, or the literals of the regexps in mRegexps
+    AhoCorasick mAutomaton;
+    std::vector<size_t> mLiteralOwners;
+    RegexSet mRegexps;
+    std::vector<size_t> mFallback;
+};
+
+// The lines of the current hunk: one growable byte buffer and an
+// offset/length/flags table, both reused from hunk to hunk. Lines from mapped
+// input are referenced relative to the mapping instead of being copied.
+class HunkArena
+{
+public:
+    enum Flag {
+        Matchable = 0x1
+    };
+
+    HunkArena(const char *base)
+        : mBase(base), mUsed(0), mPosition(0)
+    {}
+
+    void add(const char *data, size_t length, unsigned int flags)
+    {
+        Entry entry = { 0, length, flags };
+        if (mBase) {
+            entry.offset = data - mBase;
+        } else {
+            if (mUsed + length > mBuffer.size())
+                mBuffer.resize(std::max(mBuffer.size() * 2, mUsed + length));
+            if (length)
+                memcpy(&mBuffer[mUsed], data, length);
+            entry.offset = mUsed;
+            mUsed += length;
+        }
+        mEntries.push_back(entry);
+    }
+
+    void clear()
+    {
+        mEntries.clear();
+        mUsed = 0;
+    }
+
+    // position is where the next hunk starts in the input
+    void reset(const char *base, unsigned long long position)
+    {
+        clear();
+        mBase = base;
+        mPosition = position;
+    }
+
+    void swap(HunkArena &other)
+    {
+        std::swap(mBase, other.mBase);
+        mBuffer.swap(other.mBuffer);
+        std::swap(mUsed, other.mUsed);
+        mEntries.swap(other.mEntries);
+        std::swap(mPosition, other.mPosition);
+    }
+
+    // The lines of a hunk are contiguous both in the buffer and in the
+    // mapping, so the whole hunk can be written in one go.
+    const char *begin() const { return mEntries.empty() ? 0 : data(0); }
+    size_t bytes() const { return mEntries.empty() ? 0 : data(size() - 1) + length(size() - 1) - data(0); }
+    bool mapped() const { return mBase; }
+    unsigned long long position() const { return mPosition; }
+    size_t memory() const { return mUsed + mEntries.size() * sizeof(Entry); }
+
+    size_t size() const { return mEntries.size(); }
+    const char *data(size_t idx) const { return (mBase ? mBase : &mBuffer[0]) + mEntries[idx].offset; }
+    size_t length(size_t idx) const { return mEntries[idx].length; }
+    unsigned int flags(size_t idx) const { return mEntries[idx].flags; }
+
+private:
+    struct Entry
+    {
+        size_t offset;
+        size_t length;
+        unsigned int flags;
+    };
+
+    const char *mBase;
+    std::vector<char> mBuffer;
+    size_t mUsed;
+    std::vector<Entry> mEntries;
+    unsigned long long mPosition;
+};
+
+struct FilterOptions;
+
+// Decides whether to keep a hunk and which pattern decided it
+typedef bool (*HunkDecider)(const HunkArena &lines, const FilterOptions &options, size_t *match);
+
+// The decider specialized for the engine of matches and for flags
+HunkDecider selectDecider(const MatchSet &matches, unsigned int flags);
+
+// What to filter for. Set up once in main() and shared by every thread.
+struct FilterOptions
+{
+    FilterOptions(const MatchSet &m, unsigned int f)
+        : matches(m), flags(f), hunkMemory(0), stats(0), decisions(0), lines(0), predicates(0), decider(selectDecider(m, f))
+    {}
+
+    const MatchSet &matches;
+    const unsigned int flags;
+    size_t hunkMemory;
+    Stats *stats;
+    DecisionCache *decisions;
+    LineCache *lines;
+    const Predicates *predicates;
+    const HunkDecider decider;
+};
+
+// Decides on a hunk one line at a time. E is the engine of the match set and
+// V whether to be verbose, with E being MatchSet::Dynamic both are looked up
+// as needed.
+template <int E, bool V>
+class BasicHunkEvaluator
+{
+public:
+    BasicHunkEvaluator(const FilterOptions &options)
+        : mOptions(options), mExact((options.flags & Index) || options.decisions || options.stats)
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        mMatch = mOptions.matches.size();
+        mLines = 0;
+        mMatchable = mSettled = false;
+        mFacts = HunkFacts();
+    }
+
+    void line(const char *data, size_t length, unsigned int lineFlags)
+    {
+        if (mOptions.predicates)
+            mFacts.line(data, length, *mOptions.predicates);
+        if (mSettled || !(lineFlags & HunkArena::Matchable))
+            return;
+        mMatchable = true;
+        ++mLines;
+        const size_t m = first(data, length);
+        if (m < mMatch) {
+            mMatch = m;
+            if (verbose()) {
+                fprintf(stderr, "Matched %s %.*s", mOptions.matches.at(m)->toString().c_str(),
+                        static_cast<int>(length), data);
+            } else if (!m || (!mExact && mOptions.matches.decided(m))) {
+                mSettled = true;
+            }
+        }
+    }
+
+    // True once more lines can't change the outcome. A hunk the patterns
+    // keep still has to meet the --where conditions.
+    bool settled() const
+    {
+        return mSettled && (!mOptions.predicates || mOptions.matches.type(mMatch) == Match::Out);
+    }
+    // The pattern that decided the hunk, matches.size() if none did. Unless
+    // the evaluator is exact, an earlier pattern of the same type could
+    // also have matched.
+    size_t match() const { return mMatch; }
+
+    bool keep(size_t lines) const
+    {
+        const bool ret = decide(lines);
+        if (mOptions.stats)
+            mOptions.stats->hunk(mMatch, ret, mLines);
+        return ret;
+    }
+
+private:
+    bool verbose() const
+    {
+        return V || (E == MatchSet::Dynamic && (mOptions.flags & Verbose));
+    }
+
+    // The first pattern below mMatch that matches the line
+    size_t first(const char *data, size_t length) const
+    {
+        LineCache *cache = mOptions.lines;
+        if (!cache)
+            return mOptions.matches.template matchWith<E>(data, length, mMatch);
+        const uint64_t hash = xxh64(data, length);
+        size_t m;
+        if (!cache->find(hash, mMatch, &m)) {
+            m = mOptions.matches.template matchWith<E>(data, length, mMatch);
+            cache->add(hash, mMatch, m);
+        }
+        return m;
+    }
+
+    bool decide(size_t lines) const
+    {
+        const MatchSet &matches = mOptions.matches;
+        if (mMatchable && matches.hasIns() && mMatch == matches.size()) {
+            if (verbose())
+                fprintf(stderr, "Hunk was discarded because of no matches\n");
+            return false;
+        } else if (mMatch < matches.size() && matches.type(mMatch) == Match::Out) {
+            if (verbose())
+                fprintf(stderr, "Hunk was discarded because of match %zu\n", mMatch);
+            return false;
+        }
+        const char *failed = mOptions.predicates ? mOptions.predicates->failed(mFacts) : 0;
+        if (failed) {
+            if (verbose())
+                fprintf(stderr, "Hunk was discarded because of --where %s\n", failed);
+            return false;
+        }
+        if (verbose())
+            fprintf(stderr, "Hunk matched. printing %zu lines\n", lines);
+        return true;
+    }
+
+    const FilterOptions &mOptions;
+    // Whether the pattern that decided the hunk has to be the first one
+    // that matches rather than any with the same outcome. --index, --stats
+    // and the decision cache record it.
+    const bool mExact;
+    size_t mMatch, mLines;
+    bool mMatchable, mSettled;
+    HunkFacts mFacts;
+};
+
+// For hunks decided on while they're read, which is rare enough not to
+// bother specializing
+typedef BasicHunkEvaluator<MatchSet::Dynamic, false> HunkEvaluator;
+
+template <int E, bool V>
+bool decideHunk(const HunkArena &lines, const FilterOptions &options, size_t *match)
+{
+    if (V) {
+        fprintf(stderr, "Parsing hunk\n");
+        for (size_t i=0; i<lines.size(); ++i) {
+            fprintf(stderr, "%s %.*s", lines.flags(i) & HunkArena::Matchable ? "t" : "nil",
+                    static_cast<int>(lines.length(i)), lines.data(i));
+        }
+    }
+    const unsigned long long start = options.stats ? Stats::now() : 0;
+    BasicHunkEvaluator<E, V> evaluator(options);
+    for (size_t i=0; i<lines.size() && !evaluator.settled(); ++i)
+        evaluator.line(lines.data(i), lines.length(i), lines.flags(i));
+    if (options.stats)
+        options.stats->time(Stats::Match, start);
+    if (match)
+        *match = evaluator.match();
+    return evaluator.keep(lines.size());
+}
+
+// With a decision cache, a hunk that's been seen before is only hashed. Its
+// outcome can't depend on anything but its bytes, the patterns and the
+// flags, and the last two are in the cache key.
+static inline bool keepHunk(const HunkArena &lines, const FilterOptions &options, size_t *match = 0)
+{
+    if (!options.decisions)
+        return options.decider(lines, options, match);
+    const uint64_t hash = xxh64(lines.begin(), lines.bytes(), options.decisions->key());
+    bool keep;
+    size_t m;
+    if (options.decisions->find(hash, &keep, &m)) {
+        if (options.flags & Verbose)
+            fprintf(stderr, "Hunk was %s by the decision cache\n", keep ? "kept" : "discarded");
+        if (options.stats) {
+            options.stats->hunk(m, keep, 0);
+            options.stats->cached();
+        }
+    } else {
+        keep = options.decider(lines, options, &m);
+        options.decisions->add(hash, keep, m);
+    }
+    if (match)
+        *match = m;
+    return keep;
+}
+
+// Where kept hunks are written to. Mapped data stays valid until sync() has
+// been called, so an output may hold on to it instead of copying.
+class Output
+{
+public:
+    virtual ~Output()
+    {}
+
+    virtual void write(const char *data, size_t length, bool mapped) = 0;
+    virtual void sync()
+    {}
+
+    // Called for every hunk once it's been decided on, in input order and
+    // before a kept one is written. offset is relative to the start of the
+    // file, or of its decompressed contents.
+    virtual void decided(unsigned long long offset, unsigned long long length, bool keep, size_t match)
+    {
+        (void)offset;
+        (void)length;
+        (void)keep;
+        (void)match;
+    }
+
+    // Called before the data of a kept hunk is written, with the pattern
+    // that decided it or the pattern count if none did
+    virtual void route(size_t match)
+    {
+        (void)match;
+    }
+};
+
+// Gathers output into large writev(2) calls. Big chunks of mapped data get
+// an iovec of their own rather than being copied into the buffer.
+class FdOutput : public Output
+{
+public:
+    FdOutput(int fd, size_t bufferSize, Stats *stats = 0)
+        : mFd(fd), mBuffer(bufferSize), mUsed(0), mPending(0), mStats(stats), mError(0)
+    {}
+
+    ~FdOutput()
+    {
+        flush();
+    }
+
+    virtual void write(const char *data, size_t length, bool mapped)
+    {
+        if (!length)
+            return;
+        if (mapped && length >= ReferenceSize) {
+            append(data, length);
+        } else {
+            if (mUsed + length > mBuffer.size()) {
+                flush();
+                if (length > mBuffer.size()) {
+                    append(data, length);
+                    flush();
+                    return;
+                }
+            }
+            memcpy(&mBuffer[mUsed], data, length);
+            append(&mBuffer[mUsed], length);
+            mUsed += length;
+        }
+        if (mPending >= mBuffer.size() || mIovecs.size() >= MaxIovecs)
+            flush();
+    }
+
+    virtual void sync()
+    {
+        flush();
+    }
+
+    void flush()
+    {
+        struct iovec *iov = mIovecs.data();
+        size_t count = mIovecs.size();
+        const unsigned long long start = mStats && count ? Stats::now() : 0;
+        // After the first failure everything else is dropped too
+        while (count && !mError) {
+            const ssize_t written = writev(mFd, iov, std::min<size_t>(count, MaxIovecs));
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                mError = errno;
+                break;
+            }
+            if (mStats)
+                mStats->written(written);
+            size_t left = written;
+            while (count && left >= iov->iov_len) {
+                left -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+            if (count) {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+                iov->iov_len -= left;
+            }
+        }
+        if (start)
+            mStats->time(Stats::Write, start);
+        mIovecs.clear();
+        mUsed = mPending = 0;
+    }
+
+    // The errno of the first write that failed, 0 if none did
+    int error() const { return mError; }
+
+private:
+    enum {
+        ReferenceSize = 4096,
+#ifdef IOV_MAX
+        MaxIovecs = IOV_MAX
+#else
+        MaxIovecs = 16
+#endif
+    };
+
+    void append(const char *data, size_t length)
+    {
+        if (!mIovecs.empty()) {
+            struct iovec &last = mIovecs.back();
+            if (static_cast<const char *>(last.iov_base) + last.iov_len == data) {
+                last.iov_len += length;
+                mPending += length;
+                return;
+            }
+        }
+        struct iovec iov;
+        iov.iov_base = const_cast<char *>(data);
+        iov.iov_len = length;
+        mIovecs.push_back(iov);
+        mPending += length;
+    }
+
+    const int mFd;
+    std::vector<char> mBuffer;
+    size_t mUsed, mPending;
+    std::vector<struct iovec> mIovecs;
+    Stats *mStats;
+    int mError;
+};
+
+class BufferOutput : public Output
+{
+public:
+    virtual void write(const char *data, size_t length, bool)
+    {
+        mBuffer.append(data, length);
+    }
+
+    std::string &buffer() { return mBuffer; }
+
+private:
+    std::string mBuffer;
+};
+
+// One fixed size record per hunk for --index, in native byte order
+struct IndexRecord
+{
+    enum {
+        Kept = 0x80000000u, // Set in match for kept hunks
+        NoMatch = 0x7fffffffu
+    };
+
+    uint64_t offset;
+    uint64_t length;
+    uint32_t file;
+    uint32_t match;
+};
+
+// Writes what was decided about each hunk instead of the hunks themselves.
+// The text version has one line per hunk: file, offset, length, "kept" or
+// "dropped" and the pattern index or "-".
+class IndexOutput : public Output
+{
+public:
+    // patterns is the number of patterns, the match index for none
+    IndexOutput(Output &output, bool text, size_t patterns, size_t file = 0)
+        : mOutput(output), mText(text), mPatterns(patterns), mFile(file)
+    {}
+
+    // Callers have to sync before moving on to the next file
+    void setFile(size_t file) { mFile = file; }
+
+    virtual void write(const char *, size_t, bool)
+    {}
+
+    virtual void sync()
+    {
+        mOutput.sync();
+    }
+
+    virtual void decided(unsigned long long offset, unsigned long long length, bool keep, size_t match)
+    {
+        if (!length)
+            return;
+        if (mText) {
+            char buf[128];
+            char pattern[32] = "-";
+            if (match < mPatterns)
+                snprintf(pattern, sizeof(pattern), "%zu", match);
+            const int len = snprintf(buf, sizeof(buf), "%zu\t%llu\t%llu\t%s\t%s\n", mFile, offset, length,
+                                     keep ? "kept" : "dropped", pattern);
+            mOutput.write(buf, len, false);
+            return;
+        }
+        IndexRecord record;
+        record.offset = offset;
+        record.length = length;
+        record.file = mFile;
+        record.match = match < mPatterns ? static_cast<uint32_t>(match) : static_cast<uint32_t>(IndexRecord::NoMatch);
+        if (keep)
+            record.match |= IndexRecord::Kept;
+        mOutput.write(reinterpret_cast<const char *>(&record), sizeof(record), false);
+    }
+
+private:
+    Output &mOutput;
+    const bool mText;
+    const size_t mPatterns;
+    size_t mFile;
+};
+
+// Writes each kept hunk to the output of the group its pattern belongs to,
+// for --group. Hunks that no pattern decided go to the fallback.
+class SplitOutput : public Output
+{
+public:
+    // outputs has an entry for each pattern
+    SplitOutput(Output &fallback, const std::vector<Output*> &outputs)
+        : mFallback(fallback), mOutputs(outputs), mDistinct(outputs), mCurrent(&fallback)
+    {
+        mDistinct.push_back(&fallback);
+        std::sort(mDistinct.begin(), mDistinct.end());
+        mDistinct.erase(std::unique(mDistinct.begin(), mDistinct.end()), mDistinct.end());
+    }
+
+    virtual void write(const char *data, size_t length, bool mapped)
+    {
+        mCurrent->write(data, length, mapped);
+    }
+
+    virtual void sync()
+    {
+        for (std::vector<Output*>::const_iterator it = mDistinct.begin(); it != mDistinct.end(); ++it)
+            (*it)->sync();
+    }
+
+    virtual void route(size_t match)
+    {
+        mCurrent = match < mOutputs.size() ? mOutputs[match] : &mFallback;
+    }
+
+private:
+    Output &mFallback;
+    const std::vector<Output*> mOutputs;
+    std::vector<Output*> mDistinct;
+    Output *mCurrent;
+};
+
+static inline void writeHunk(const HunkArena &lines, Output &output)
+{
+    output.write(lines.begin(), lines.bytes(), lines.mapped());
+}
+
+// Receives hunks from HunkSplitter. An implementation may take over the
+// contents of the arena by swapping it with one of its own, the splitter
+// resets it either way.
+class HunkHandler
+{
+public:
+    virtual ~HunkHandler()
+    {}
+
+    virtual void hunk(HunkArena &lines) = 0;
+
+    // Called before the data that previous hunks refer to goes away. Once
+    // it returns everything passed to hunk() has been written.
+    virtual void sync()
+    {}
+
+    virtual Output &output() = 0;
+};
+
+class SerialFilter : public HunkHandler
+{
+public:
+    SerialFilter(const FilterOptions &options, Output &output)
+        : mOptions(options), mOutput(output)
+    {}
+
+    virtual void hunk(HunkArena &lines)
+    {
+        size_t match;
+        const bool keep = keepHunk(lines, mOptions, &match);
+        mOutput.decided(lines.position(), lines.bytes(), keep, match);
+        if (keep) {
+            mOutput.route(match);
+            writeHunk(lines, mOutput);
+        }
+    }
+
+    virtual void sync()
+    {
+        mOutput.sync();
+    }
+
+    virtual Output &output()
+    {
+        return mOutput;
+    }
+
+private:
+    const FilterOptions &mOptions;
+    Output &mOutput;
+};
+
+// Collects hunks into batches that a pool of workers decides on, while a
+// writer thread prints the kept hunks in their original order. The number
+// of batches in flight is bounded so a slow writer stalls the reader rather
+// than piling up input.
+class ParallelFilter : public HunkHandler
+{
+public:
+    ParallelFilter(const FilterOptions &options, size_t jobs, Output &output);
+    ~ParallelFilter();
+
+    virtual void hunk(HunkArena &lines);
+    virtual void sync();
+    virtual Output &output()
+    {
+        return mOutput;
+    }
+
+private:
+    enum { BatchLines = 16384 };
+
+    struct Batch
+    {
+        Batch()
+            : count(0), lines(0), done(false)
+        {}
+
+        std::vector<HunkArena> hunks;
+        std::vector<char> keep;
+        std::vector<size_t> match;
+        size_t count, lines;
+        bool done;
+    };
+
+    Batch *takeBatch();
+    void dispatch();
+    void work();
+    void write();
+
+    const FilterOptions &mOptions;
+    Output &mOutput;
+    const size_t mMaxBatches;
+    size_t mBatchCount;
+    Batch *mCurrent;
+    bool mStop;
+    std::mutex mMutex;
+    std::condition_variable mWorkCondition, mWriteCondition, mFreeCondition;
+    std::deque<Batch*> mQueue, mOrder;
+    std::vector<Batch*> mFree;
+    std::vector<std::thread> mWorkers;
+    std::thread mWriter;
+};
+
+// Splits a diff into hunks, one line at a time. With a base pointer lines
+// are referenced in place and must stay valid until the handler has been
+// synced, otherwise they are copied into the arena.
+//
+// A hunk that outgrows options.hunkMemory is decided on as it is read
+// instead. Until its outcome is known its lines go to a temporary file, or
+// for mapped input are just tracked as a range, and after that straight to
+// the output or nowhere.
+class HunkSplitter
+{
+public:
+    HunkSplitter(const char *base, HunkHandler &handler, const FilterOptions &options,
+                 unsigned long long position = 0)
+        : mHandler(handler), mOptions(options), mSeenHunkStart(false), mBase(base), mPending(base),
+          mSpill(NotSpilling), mEvaluator(options), mSpillFile(0), mSpillBegin(0), mSpillLength(0),
+          mSpillLines(0), mSpillPosition(0), mSpillKeep(false), mSpillDisabled(false), mFileState(Preamble), mSeenOld(false),
+          mFileMatch(0), mSectionStart(position), mSpanBegin(0), mSpanLength(0), mPosition(position)
+    {
+        // Which kinds of lines are matched only depends on the flags
+        const unsigned int flags = options.flags;
+        mLineFlags[HunkStartLine] = mLineFlags[HeaderLine] = mLineFlags[OtherLine] =
+            flags & MatchHeaders ? HunkArena::Matchable : 0;
+        mLineFlags[ChangeLine] = HunkArena::Matchable;
+        mLineFlags[ContextLine] = flags & MatchContext ? HunkArena::Matchable : 0;
+        mPending.reset(base, position);
+    }
+
+    ~HunkSplitter()
+    {
+        if (mSpillFile)
+            fclose(mSpillFile);
+    }
+
+    void line(const char *data, size_t length, LineKind kind)
+    {
+        if (mOptions.flags & Files) {
+            fileLine(data, length, kind);
+            mPosition += length;
+            return;
+        }
+        if (kind == HunkStartLine) {
+            if (mSeenHunkStart)
+                flush();
+            mSeenHunkStart = true;
+        } else if (kind == OtherLine && mSeenHunkStart) {
+            flush();
+            mSeenHunkStart = false;
+        }
+        const unsigned int lineFlags = mLineFlags[kind];
+        if (mSpill != NotSpilling) {
+            spill(data, length, lineFlags);
+        } else {
+            mPending.add(data, length, lineFlags);
+            if (mOptions.hunkMemory && mPending.memory() > mOptions.hunkMemory)
+                startSpill();
+        }
+        mPosition += length;
+    }
+
+    // For input that was skipped instead of being passed to line()
+    void skipped(size_t length) { mPosition += length; }
+
+    unsigned long long position() const { return mPosition; }
+
+    // True while the rest of a dropped file section's hunks can be skipped
+    // without passing them to line()
+    bool skipping() const { return mFileState == DropBody; }
+
+    // Why a kept hunk couldn't be written in full, empty if they all were
+    const std::string &error() const { return mError; }
+
+    void finish()
+    {
+        if (mOptions.flags & Files) {
+            endFile();
+            flushSpan();
+            return;
+        }
+        flush();
+    }
+
+private:
+    enum SpillState {
+        NotSpilling,
+        Spilling,
+        Passing,
+        Dropping
+    };
+
+    enum FileState {
+        Preamble,
+        KeepBody,
+        DropBody
+    };
+
+    // With --files a file section is everything up to its first hunk, in
+    // which only the "diff ", "--- " and "+++ " lines naming the paths are
+    // matched, followed by its hunks. A "diff " line, a second "--- " line or
+    // any other line after the hunks start a new section, except for the
+    // "\ No newline at end of file" markers between them. The section is
+    // decided on once its first hunk starts, after which the hunks are
+    // written or dropped without being looked at.
+    void fileLine(const char *data, size_t length, LineKind kind)
+    {
+        const bool diff = kind == OtherLine && length >= 5 && !memcmp(data, "diff ", 5);
+        bool header = diff;
+        if (kind == OtherLine && mFileState != Preamble && isNoNewlineMarker(data, length)) {
+            if (mFileState == KeepBody)
+                emit(data, length);
+            return;
+        }
+        if (kind == OtherLine) {
+            if (mFileState != Preamble || diff)
+                endFile();
+        } else if (kind == HunkStartLine && data[0] == '-') {
+            if (mFileState != Preamble || mSeenOld)
+                endFile();
+            mSeenOld = header = true;
+        } else if (kind == HeaderLine && data[0] == '+') {
+            header = mFileState == Preamble;
+        }
+        if (mFileState == Preamble) {
+            if (header || kind == OtherLine) {
+                mPending.add(data, length, header ? HunkArena::Matchable : 0);
+                return;
+            }
+            decideFile();
+        }
+        if (mFileState == KeepBody)
+            emit(data, length);
+    }
+
+    void decideFile()
+    {
+        const bool keep = keepHunk(mPending, mOptions, &mFileMatch);
+        if (keep) {
+            // A span can't go on into a section for another output
+            flushSpan();
+            mHandler.output().route(mFileMatch);
+            emit(mPending.begin(), mPending.bytes());
+        }
+        mPending.reset(mBase, mPosition);
+        mFileState = keep ? KeepBody : DropBody;
+    }
+
+    // Each file section counts as one hunk for decided()
+    void endFile()
+    {
+        if (mFileState == Preamble && mPending.size())
+            decideFile();
+        if (mFileState != Preamble)
+            mHandler.output().decided(mSectionStart, mPosition - mSectionStart, mFileState == KeepBody, mFileMatch);
+        mFileState = Preamble;
+        mSeenOld = false;
+        mSectionStart = mPosition;
+    }
+
+    // Kept mapped data is collected into one span for as long as it's
+    // contiguous, which it is for whole runs of kept sections.
+    void emit(const char *data, size_t length)
+    {
+        if (mBase) {
+            if (mSpanLength && mSpanBegin + mSpanLength == data) {
+                mSpanLength += length;
+                return;
+            }
+            flushSpan();
+            mSpanBegin = data;
+            mSpanLength = length;
+        } else {
+            mHandler.output().write(data, length, false);
+        }
+    }
+
+    void flushSpan()
+    {
+        if (mSpanLength)
+            mHandler.output().write(mSpanBegin, mSpanLength, true);
+        mSpanLength = 0;
+    }
+
+    void flush()
+    {
+        if (mSpill != NotSpilling) {
+            if (mSpill == Spilling && (mSpillKeep = mEvaluator.keep(mSpillLines)))
+                pass();
+            if (mOptions.flags & Index) {
+                // After whatever the handler still holds
+                mHandler.sync();
+                mHandler.output().decided(mSpillPosition, mSpillLength, mSpillKeep, mEvaluator.match());
+            }
+            mSpill = NotSpilling;
+        } else {
+            mHandler.hunk(mPending);
+        }
+        mPending.reset(mBase, mPosition);
+    }
+
+    void startSpill()
+    {
+        mSpillLength = mPending.bytes();
+        mSpillPosition = mPending.position();
+        if (mBase) {
+            mSpillBegin = mPending.begin();
+        } else {
+            if (mSpillDisabled)
+                return;
+            if (!mSpillFile)
+                mSpillFile = tmpfile();
+            if (mSpillFile)
+                rewind(mSpillFile);
+            if (!mSpillFile || ftruncate(fileno(mSpillFile), 0)
+                || fwrite(mPending.begin(), mPending.bytes(), 1, mSpillFile) != 1) {
+                // Nowhere to spill to, so this and every later hunk is kept
+                // in memory after all instead of trying again
+                fprintf(stderr, "Can't spill hunks to a temporary file, keeping them in memory: %s\n",
+                        strerror(errno));
+                mSpillDisabled = true;
+                return;
+            }
+        }
+        const unsigned long long start = mOptions.stats ? Stats::now() : 0;
+        mEvaluator.reset();
+        for (size_t i=0; i<mPending.size(); ++i)
+            mEvaluator.line(mPending.data(i), mPending.length(i), mPending.flags(i));
+        if (mOptions.stats)
+            mOptions.stats->time(Stats::Match, start);
+        mSpillLines = mPending.size();
+        mPending.reset(mBase, mPosition);
+        mSpill = Spilling;
+        settle();
+    }
+
+    void spill(const char *data, size_t length, unsigned int lineFlags)
+    {
+        mSpillLength += length;
+        switch (mSpill) {
+        case Spilling:
+            if (!mBase && fwrite(data, length, 1, mSpillFile) != 1 && mError.empty())
+                mError = std::string("Can't write to the spill file: ") + strerror(errno);
+            ++mSpillLines;
+            if (mOptions.stats) {
+                const unsigned long long start = Stats::now();
+                mEvaluator.line(data, length, lineFlags);
+                mOptions.stats->time(Stats::Match, start);
+            } else {
+                mEvaluator.line(data, length, lineFlags);
+            }
+            settle();
+            break;
+        case Passing:
+            mHandler.output().write(data, length, mBase);
+            break;
+        default:
+            break;
+        }
+    }
+
+    void settle()
+    {
+        if (!mEvaluator.settled())
+            return;
+        mSpillKeep = mEvaluator.keep(mSpillLines);
+        if (mSpillKeep) {
+            pass();
+            mSpill = Passing;
+        } else {
+            mSpill = Dropping;
+        }
+    }
+
+    // Writes what has been spilled so far, after everything before it
+    void pass()
+    {
+        mHandler.sync();
+        Output &output = mHandler.output();
+        output.route(mEvaluator.match());
+        if (mBase) {
+            output.write(mSpillBegin, mSpillLength, true);
+            return;
+        }
+        char buf[65536];
+        if (fflush(mSpillFile) && mError.empty())
+            mError = std::string("Can't write to the spill file: ") + strerror(errno);
+        rewind(mSpillFile);
+        size_t read;
+        while ((read = fread(buf, 1, sizeof(buf), mSpillFile)))
+            output.write(buf, read, false);
+        if (ferror(mSpillFile) && mError.empty())
+            mError = std::string("Can't read the spill file: ") + strerror(errno);
+    }
+
+    HunkHandler &mHandler;
+    const FilterOptions &mOptions;
+    bool mSeenHunkStart;
+    const char *mBase;
+    HunkArena mPending;
+    SpillState mSpill;
+    HunkEvaluator mEvaluator;
+    FILE *mSpillFile;
+    const char *mSpillBegin;
+    size_t mSpillLength, mSpillLines;
+    unsigned long long mSpillPosition;
+    bool mSpillKeep;
+    // Set once spilling failed, later hunks aren't spilled at all
+    bool mSpillDisabled;
+    std::string mError;
+    FileState mFileState;
+    bool mSeenOld;
+    size_t mFileMatch;
+    unsigned long long mSectionStart;
+    const char *mSpanBegin;
+    size_t mSpanLength;
+    // Bytes passed to line() or skipped so far
+    unsigned long long mPosition;
+    unsigned char mLineFlags[OtherLine + 1];
+};
+
+bool parseSize(const char *arg, size_t *size);
+
+// Reads fd until the end. Compressed input is recognized by its magic bytes
+// and decompressed on a thread of its own. Returns false with a reason in
+// error if reading or decompressing fails. With position the input is taken
+// to start there, for --index, and position is moved past it.
+bool processFile(int fd, HunkHandler &handler, const FilterOptions &options, std::string *error = 0,
+                 unsigned long long *position = 0);
+void processFile(const char *data, size_t size, HunkHandler &handler, const FilterOptions &options);
+// Splits whatever source hands out, in blocks of any size, into hunks.
+// Returns false with a reason in error if a kept hunk that was spilled
+// couldn't be written out in full.
+bool processBlocks(BlockSource &source, HunkHandler &handler, const FilterOptions &options, std::string *error = 0,
+                   unsigned long long *position = 0);
+bool processPath(const char *path, HunkHandler &handler, const FilterOptions &options, std::string *error = 0);
+bool processPaths(char **paths, size_t count, const FilterOptions &options, size_t jobs, Output &output);
+
+#endif
@@ -0,0 +1,143 @@
+#include "HunkFilter.h"
+#include "Hunk.h"
+#include <memory>
+#include <mutex>
+
+static_assert(static_cast<int>(HunkFilter::MatchContext) == static_cast<int>(::MatchContext)
+              && static_cast<int>(HunkFilter::MatchHeaders) == static_cast<int>(::MatchHeaders)
+              && static_cast<int>(HunkFilter::Raw) == static_cast<int>(::Raw)
+              && static_cast<int>(HunkFilter::Files) == static_cast<int>(::Files),
+              "HunkFilter flags must match the tool's");
+
+// The patterns as they were when compiled. Filtering holds on to one for as
+// long as it runs so patterns can be added meanwhile, the next filter()
+// compiles a new one.
+struct Compiled
+{
+    Compiled(const std::vector<Match*> &m, unsigned int flags)
+        : matches(m), matchSet(matches, flags), options(matchSet, flags)
+    {}
+
+    // MatchSet keeps a reference, the Match objects themselves live as long
+    // as the HunkFilter
+    const std::vector<Match*> matches;
+    const MatchSet matchSet;
+    const FilterOptions options;
+
+private:
+    Compiled(const Compiled &);
+    Compiled &operator=(const Compiled &);
+};
+
+struct HunkFilter::Data
+{
+    Data(unsigned int f)
+        : flags(f & (MatchContext | MatchHeaders | Raw | Files))
+    {}
+
+    ~Data()
+    {
+        for (std::vector<Match*>::const_iterator it = matches.begin(); it != matches.end(); ++it)
+            delete *it;
+    }
+
+    const unsigned int flags;
+    // Match only points at its pattern, so the strings have to stay put
+    std::deque<std::string> patterns;
+    std::vector<Match*> matches;
+
+    // Compiled on first use after a pattern was added
+    std::mutex mutex;
+    std::shared_ptr<const Compiled> compiled;
+};
+
+// Hands each kept hunk to the caller. Nothing is spilled without a hunk
+// memory limit so every write is exactly one hunk.
+class CallbackOutput : public Output
+{
+public:
+    CallbackOutput(HunkFilter::Callback callback, void *userData)
+        : mCallback(callback), mUserData(userData), mCount(0)
+    {}
+
+    virtual void write(const char *data, size_t length, bool)
+    {
+        ++mCount;
+        mCallback(data, length, mUserData);
+    }
+
+    size_t count() const { return mCount; }
+
+private:
+    HunkFilter::Callback mCallback;
+    void *mUserData;
+    size_t mCount;
+};
+
+HunkFilter::HunkFilter(unsigned int flags)
+    : mData(new Data(flags))
+{
+}
+
+HunkFilter::~HunkFilter()
+{
+    delete mData;
+}
+
+bool HunkFilter::addIn(const char *pattern)
+{
+    return add(true, pattern);
+}
+
+bool HunkFilter::addOut(const char *pattern)
+{
+    return add(false, pattern);
+}
+
+bool HunkFilter::add(bool in, const char *pattern)
+{
+    std::lock_guard<std::mutex> lock(mData->mutex);
+    mData->patterns.push_back(pattern);
+    char *copy = &mData->patterns.back()[0];
+    const Match::Type type = in ? Match::In : Match::Out;
+    if (mData->flags & Raw) {
+        mData->matches.push_back(new RawMatch(type, copy));
+    } else {
+        RegexpMatch *match = new RegexpMatch(type, copy);
+        if (!match->isValid()) {
+            delete match;
+            mData->patterns.pop_back();
+            return false;
+        }
+        mData->matches.push_back(match);
+    }
+    mData->compiled.reset();
+    return true;
+}
+
+size_t HunkFilter::filter(const char *data, size_t length, Callback callback, void *userData) const
+{
+    std::shared_ptr<const Compiled> compiled;
+    {
+        std::lock_guard<std::mutex> lock(mData->mutex);
+        if (!mData->compiled)
+            mData->compiled.reset(new Compiled(mData->matches, mData->flags));
+        compiled = mData->compiled;
+    }
+    if (!length)
+        return 0;
+    CallbackOutput output(callback, userData);
+    SerialFilter handler(compiled->options, output);
+    processFile(data, length, handler, compiled->options);
+    return output.count();
+}
+
+static void append(const char *data, size_t length, void *userData)
+{
+    static_cast<std::string *>(userData)->append(data, length);
+}
+
+size_t HunkFilter::filter(const char *data, size_t length, std::string &out) const
+{
+    return filter(data, length, append, &out);
+}
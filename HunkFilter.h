@@ -0,0 +1,51 @@
+#ifndef HunkFilter_h
+#define HunkFilter_h
+
+#include <string>
+#include <stddef.h>
+
+// Embeddable version of the hunk command line tool. Patterns are added and
+// compiled once, after which any number of diffs held in memory can be
+// filtered, from several threads at once if need be. Patterns may be added
+// while other threads filter, those filter() calls go on with the patterns
+// they started with. Kept hunks are passed on as spans of the input buffer,
+// nothing is copied unless asked for.
+class HunkFilter
+{
+public:
+    enum Flag {
+        MatchContext = 0x1,
+        MatchHeaders = 0x2,
+        Raw = 0x4,
+        Files = 0x10 // Decide on whole file sections by their paths
+    };
+
+    HunkFilter(unsigned int flags = 0);
+    ~HunkFilter();
+
+    // Patterns are regexps as understood by regcomp(3) unless Raw is set, and
+    // take priority in the order they're added. Returns false if pattern
+    // isn't a valid regexp.
+    bool addIn(const char *pattern);
+    bool addOut(const char *pattern);
+
+    // Called for every kept hunk with a span of the buffer passed to filter()
+    typedef void (*Callback)(const char *data, size_t length, void *userData);
+
+    // Returns the number of times callback was called. That's once per kept
+    // hunk, but with Files a run of kept file sections is passed on as one
+    // span.
+    size_t filter(const char *data, size_t length, Callback callback, void *userData) const;
+    size_t filter(const char *data, size_t length, std::string &out) const;
+
+private:
+    HunkFilter(const HunkFilter &);
+    HunkFilter &operator=(const HunkFilter &);
+
+    bool add(bool in, const char *pattern);
+
+    struct Data;
+    Data *mData;
+};
+
+#endif
@@ -0,0 +1,58 @@
+#include "LineCache.h"
+#include <string.h>
+
+LineCache::LineCache(size_t size)
+{
+    // A power of two per shard, at least one
+    size_t perShard = 1;
+    while (perShard * 2 * ShardCount * sizeof(Entry) <= size)
+        perShard *= 2;
+    mMask = perShard - 1;
+    for (size_t i=0; i<ShardCount; ++i) {
+        mShards[i].entries.resize(perShard);
+        memset(&mShards[i].entries[0], 0, perShard * sizeof(Entry));
+    }
+}
+
+bool LineCache::find(uint64_t hash, size_t limit, size_t *match)
+{
+    Shard &s = shard(hash);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    ++s.lookups;
+    const Entry &entry = s.entries[slot(hash)];
+    if (entry.hash != hash || (entry.match == entry.limit && limit > entry.limit))
+        return false;
+    ++s.hits;
+    *match = entry.match < limit ? entry.match : limit;
+    return true;
+}
+
+void LineCache::add(uint64_t hash, size_t limit, size_t match)
+{
+    Shard &s = shard(hash);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    Entry &entry = s.entries[slot(hash)];
+    entry.hash = hash;
+    entry.match = match;
+    entry.limit = limit;
+}
+
+unsigned long long LineCache::lookups() const
+{
+    unsigned long long ret = 0;
+    for (size_t i=0; i<ShardCount; ++i) {
+        std::lock_guard<std::mutex> lock(mShards[i].mutex);
+        ret += mShards[i].lookups;
+    }
+    return ret;
+}
+
+unsigned long long LineCache::hits() const
+{
+    unsigned long long ret = 0;
+    for (size_t i=0; i<ShardCount; ++i) {
+        std::lock_guard<std::mutex> lock(mShards[i].mutex);
+        ret += mShards[i].hits;
+    }
+    return ret;
+}
@@ -0,0 +1,59 @@
+#ifndef LineCache_h
+#define LineCache_h
+
+#include <mutex>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Remembers the first pattern that matched a line, by a hash of its bytes,
+// for diffs that repeat the same lines over and over. It's a fixed number
+// of direct mapped slots, a line that lands on a taken slot replaces what
+// was there. The slots are split into shards with a lock each so threads
+// deciding on hunks at the same time rarely wait for each other.
+class LineCache
+{
+public:
+    // size is the memory to use, in bytes
+    LineCache(size_t size);
+
+    // A line that was matched with limit l and had no match below it is
+    // only known for limits up to l
+    bool find(uint64_t hash, size_t limit, size_t *match);
+    void add(uint64_t hash, size_t limit, size_t match);
+
+    unsigned long long lookups() const;
+    unsigned long long hits() const;
+
+private:
+    LineCache(const LineCache &);
+    LineCache &operator=(const LineCache &);
+
+    enum { ShardCount = 64 };
+
+    struct Entry
+    {
+        uint64_t hash;
+        uint32_t match, limit;
+    };
+
+    struct Shard
+    {
+        Shard()
+            : lookups(0), hits(0)
+        {}
+
+        mutable std::mutex mutex;
+        std::vector<Entry> entries;
+        unsigned long long lookups, hits;
+    };
+
+    Shard &shard(uint64_t hash) { return mShards[hash % ShardCount]; }
+    // The low bits picked the shard
+    size_t slot(uint64_t hash) const { return (hash / ShardCount) & mMask; }
+
+    Shard mShards[ShardCount];
+    size_t mMask;
+};
+
+#endif
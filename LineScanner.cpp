@@ -0,0 +1,426 @@
+#include "LineScanner.h"
+#include <stdint.h>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+// Every x86 kernel is compiled for its own instruction set and the best one
+// the CPU has is picked at runtime, so no -march is needed to get them
+#define RUNTIME_DISPATCH
+#define TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#ifndef TARGET
+#define TARGET(isa)
+#endif
+#if defined(RUNTIME_DISPATCH) || defined(__SSE2__)
+#define SSE2_KERNEL
+#endif
+
+enum Kernel {
+    ScalarKernel,
+    Sse2Kernel,
+    Avx2Kernel,
+    Avx512Kernel,
+    NeonKernel,
+    KernelCount
+};
+
+static const char *const kernelNames[KernelCount] = { "scalar", "sse2", "avx2", "avx512", "neon" };
+
+static bool kernelSupported(Kernel kernel)
+{
+    switch (kernel) {
+    case ScalarKernel:
+        return true;
+#if defined(RUNTIME_DISPATCH)
+    case Sse2Kernel:
+        return __builtin_cpu_supports("sse2");
+    case Avx2Kernel:
+        return __builtin_cpu_supports("avx2");
+    case Avx512Kernel:
+        return __builtin_cpu_supports("avx512bw");
+#elif defined(__SSE2__)
+    case Sse2Kernel:
+        return true;
+#elif defined(__ARM_NEON)
+    case NeonKernel:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+static Kernel bestKernel()
+{
+#if defined(RUNTIME_DISPATCH)
+    // Might be called from a static constructor, before libgcc's has run
+    __builtin_cpu_init();
+#endif
+    for (int kernel = KernelCount - 1; kernel > ScalarKernel; --kernel) {
+        if (kernelSupported(static_cast<Kernel>(kernel)))
+            return static_cast<Kernel>(kernel);
+    }
+    return ScalarKernel;
+}
+
+static Kernel &currentKernel()
+{
+    static Kernel kernel = bestKernel();
+    return kernel;
+}
+
+const char *lineKernel()
+{
+    return kernelNames[currentKernel()];
+}
+
+const char *lineKernelName(size_t i)
+{
+    return i < KernelCount ? kernelNames[i] : 0;
+}
+
+bool setLineKernel(const char *name)
+{
+    for (int kernel = ScalarKernel; kernel < KernelCount; ++kernel) {
+        if (!strcmp(name, kernelNames[kernel])) {
+            if (!kernelSupported(static_cast<Kernel>(kernel)))
+                return false;
+            currentKernel() = static_cast<Kernel>(kernel);
+            return true;
+        }
+    }
+    return false;
+}
+
+// The newline kernels call visitor with the offset after each newline from
+// pos on, a vector at a time, until it returns true. They return whether it
+// did and leave pos where the last vector that fit ended.
+#if defined(RUNTIME_DISPATCH)
+template <typename Visitor>
+TARGET("avx512f,avx512bw") static bool newlinesAvx512(const char *data, size_t length, size_t &pos, Visitor &visitor)
+{
+    const __m512i newline = _mm512_set1_epi8('\n');
+    for (; pos + 64 <= length; pos += 64) {
+        uint64_t mask = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(data + pos), newline);
+        while (mask) {
+            if (visitor(pos + __builtin_ctzll(mask) + 1))
+                return true;
+            mask &= mask - 1;
+        }
+    }
+    return false;
+}
+
+template <typename Visitor>
+TARGET("avx2") static bool newlinesAvx2(const char *data, size_t length, size_t &pos, Visitor &visitor)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; pos + 32 <= length; pos += 32) {
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + pos));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+        while (mask) {
+            if (visitor(pos + __builtin_ctz(mask) + 1))
+                return true;
+            mask &= mask - 1;
+        }
+    }
+    return false;
+}
+#endif
+
+#if defined(SSE2_KERNEL)
+template <typename Visitor>
+TARGET("sse2") static bool newlinesSse2(const char *data, size_t length, size_t &pos, Visitor &visitor)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; pos + 16 <= length; pos += 16) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        while (mask) {
+            if (visitor(pos + __builtin_ctz(mask) + 1))
+                return true;
+            mask &= mask - 1;
+        }
+    }
+    return false;
+}
+#endif
+
+#if defined(__ARM_NEON)
+template <typename Visitor>
+static bool newlinesNeon(const char *data, size_t length, size_t &pos, Visitor &visitor)
+{
+    // No movemask on NEON; narrowing shift gives four bits per byte instead
+    const uint8x16_t newline = vdupq_n_u8('\n');
+    for (; pos + 16 <= length; pos += 16) {
+        const uint8x16_t eq = vceqq_u8(vld1q_u8(reinterpret_cast<const uint8_t *>(data + pos)), newline);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        mask &= 0x8888888888888888ull;
+        while (mask) {
+            if (visitor(pos + (__builtin_ctzll(mask) >> 2) + 1))
+                return true;
+            mask &= mask - 1;
+        }
+    }
+    return false;
+}
+#endif
+
+// Calls visitor with the offset after each newline in data, in order,
+// until it returns true. Returns whether it did.
+template <typename Visitor>
+static inline bool forEachLine(const char *data, size_t length, Visitor &visitor)
+{
+    size_t pos = 0;
+    bool stopped = false;
+    switch (currentKernel()) {
+#if defined(RUNTIME_DISPATCH)
+    case Avx512Kernel:
+        stopped = newlinesAvx512(data, length, pos, visitor);
+        break;
+    case Avx2Kernel:
+        stopped = newlinesAvx2(data, length, pos, visitor);
+        break;
+#endif
+#if defined(SSE2_KERNEL)
+    case Sse2Kernel:
+        stopped = newlinesSse2(data, length, pos, visitor);
+        break;
+#endif
+#if defined(__ARM_NEON)
+    case NeonKernel:
+        stopped = newlinesNeon(data, length, pos, visitor);
+        break;
+#endif
+    default:
+        break;
+    }
+    if (stopped)
+        return true;
+    while (pos < length) {
+        const char *nl = static_cast<const char *>(memchr(data + pos, '\n', length - pos));
+        if (!nl)
+            break;
+        pos = nl - data + 1;
+        if (visitor(pos))
+            return true;
+    }
+    return false;
+}
+
+class RecordAdder
+{
+public:
+    RecordAdder(const char *data, size_t length, std::vector<LineRecord> &records)
+        : mData(data), mLength(length), mRecords(records)
+    {}
+
+    bool operator()(size_t offset)
+    {
+        const LineRecord record = { offset, classifyLine(mData + offset, mLength - offset) };
+        mRecords.push_back(record);
+        return false;
+    }
+
+private:
+    const char *mData;
+    const size_t mLength;
+    std::vector<LineRecord> &mRecords;
+};
+
+size_t scanLines(const char *data, size_t length, bool last, std::vector<LineRecord> &records)
+{
+    const size_t first = records.size();
+    RecordAdder adder(data, length, records);
+    if (length)
+        adder(0);
+    forEachLine(data, length, adder);
+
+    // Every newline added a record for the line after it, including the
+    // one at the very end. That one becomes the terminating record unless
+    // it starts an incomplete line that should be left for the next call.
+    size_t consumed = length;
+    if (records.size() > first) {
+        LineRecord &tail = records.back();
+        if (tail.offset == length) {
+            tail.kind = OtherLine;
+        } else if (last) {
+            const LineRecord end = { length, OtherLine };
+            records.push_back(end);
+        } else {
+            consumed = tail.offset;
+            tail.kind = OtherLine;
+        }
+    }
+    return consumed;
+}
+
+// Stops at the first line that isn't part of a file section's hunks
+class BoundaryFinder
+{
+public:
+    BoundaryFinder(const char *data, size_t length)
+        : mData(data), mLength(length), mFound(length)
+    {}
+
+    bool operator()(size_t offset)
+    {
+        if (offset == mLength)
+            return false;
+        const char *line = mData + offset;
+        const size_t left = mLength - offset;
+        switch (*line) {
+        case '+':
+        case ' ':
+        case '<':
+        case '>':
+        case '\\':
+            return false;
+        case '-':
+            if (left < 4 || memcmp(line, "--- ", 4))
+                return false;
+            break;
+        default:
+            if (classifyLine(line, left) != OtherLine)
+                return false;
+            break;
+        }
+        mFound = offset;
+        return true;
+    }
+
+    size_t found() const { return mFound; }
+
+private:
+    const char *mData;
+    const size_t mLength;
+    size_t mFound;
+};
+
+// The boundary kernels compare every byte against the byte before it, so
+// only lines that start with something other than '+', ' ', '<', '>', '\'
+// or a digit have to be looked at one by one. Like the newline kernels they
+// return whether finder stopped and leave pos after the last full vector.
+#if defined(RUNTIME_DISPATCH)
+TARGET("avx512f,avx512bw") static bool boundaryAvx512(const char *data, size_t length, size_t &pos, BoundaryFinder &finder)
+{
+    const __m512i newline = _mm512_set1_epi8('\n');
+    const __m512i plus = _mm512_set1_epi8('+'), space = _mm512_set1_epi8(' ');
+    const __m512i less = _mm512_set1_epi8('<'), greater = _mm512_set1_epi8('>');
+    const __m512i zero = _mm512_set1_epi8('0'), nine = _mm512_set1_epi8(9);
+    const __m512i backslash = _mm512_set1_epi8('\\');
+    for (; pos + 64 <= length; pos += 64) {
+        const __m512i prev = _mm512_loadu_si512(data + pos - 1);
+        const __m512i chunk = _mm512_loadu_si512(data + pos);
+        uint64_t body = _mm512_cmple_epu8_mask(_mm512_sub_epi8(chunk, zero), nine);
+        body |= _mm512_cmpeq_epi8_mask(chunk, plus) | _mm512_cmpeq_epi8_mask(chunk, space);
+        body |= _mm512_cmpeq_epi8_mask(chunk, less) | _mm512_cmpeq_epi8_mask(chunk, greater);
+        body |= _mm512_cmpeq_epi8_mask(chunk, backslash);
+        uint64_t mask = _mm512_cmpeq_epi8_mask(prev, newline) & ~body;
+        while (mask) {
+            if (finder(pos + __builtin_ctzll(mask)))
+                return true;
+            mask &= mask - 1;
+        }
+    }
+    return false;
+}
+
+TARGET("avx2") static bool boundaryAvx2(const char *data, size_t length, size_t &pos, BoundaryFinder &finder)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i plus = _mm256_set1_epi8('+'), space = _mm256_set1_epi8(' ');
+    const __m256i less = _mm256_set1_epi8('<'), greater = _mm256_set1_epi8('>');
+    const __m256i zero = _mm256_set1_epi8('0'), nine = _mm256_set1_epi8(9);
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    for (; pos + 32 <= length; pos += 32) {
+        const __m256i prev = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + pos - 1));
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + pos));
+        const __m256i digit = _mm256_sub_epi8(chunk, zero);
+        __m256i body = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, nine), digit);
+        body = _mm256_or_si256(body, _mm256_or_si256(_mm256_cmpeq_epi8(chunk, plus), _mm256_cmpeq_epi8(chunk, space)));
+        body = _mm256_or_si256(body, _mm256_or_si256(_mm256_cmpeq_epi8(chunk, less), _mm256_cmpeq_epi8(chunk, greater)));
+        body = _mm256_or_si256(body, _mm256_cmpeq_epi8(chunk, backslash));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_andnot_si256(body, _mm256_cmpeq_epi8(prev, newline)));
+        while (mask) {
+            if (finder(pos + __builtin_ctz(mask)))
+                return true;
+            mask &= mask - 1;
+        }
+    }
+    return false;
+}
+#endif
+
+#if defined(SSE2_KERNEL)
+TARGET("sse2") static bool boundarySse2(const char *data, size_t length, size_t &pos, BoundaryFinder &finder)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i plus = _mm_set1_epi8('+'), space = _mm_set1_epi8(' ');
+    const __m128i less = _mm_set1_epi8('<'), greater = _mm_set1_epi8('>');
+    const __m128i zero = _mm_set1_epi8('0'), nine = _mm_set1_epi8(9);
+    const __m128i backslash = _mm_set1_epi8('\\');
+    for (; pos + 16 <= length; pos += 16) {
+        const __m128i prev = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos - 1));
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+        const __m128i digit = _mm_sub_epi8(chunk, zero);
+        __m128i body = _mm_cmpeq_epi8(_mm_min_epu8(digit, nine), digit);
+        body = _mm_or_si128(body, _mm_or_si128(_mm_cmpeq_epi8(chunk, plus), _mm_cmpeq_epi8(chunk, space)));
+        body = _mm_or_si128(body, _mm_or_si128(_mm_cmpeq_epi8(chunk, less), _mm_cmpeq_epi8(chunk, greater)));
+        body = _mm_or_si128(body, _mm_cmpeq_epi8(chunk, backslash));
+        unsigned int mask = _mm_movemask_epi8(_mm_andnot_si128(body, _mm_cmpeq_epi8(prev, newline)));
+        while (mask) {
+            if (finder(pos + __builtin_ctz(mask)))
+                return true;
+            mask &= mask - 1;
+        }
+    }
+    return false;
+}
+#endif
+
+size_t skipHunks(const char *data, size_t length)
+{
+    if (!length)
+        return 0;
+    BoundaryFinder finder(data, length);
+    if (finder(0))
+        return 0;
+    size_t pos = 1;
+    bool stopped = false;
+    switch (currentKernel()) {
+#if defined(RUNTIME_DISPATCH)
+    case Avx512Kernel:
+        stopped = boundaryAvx512(data, length, pos, finder);
+        break;
+    case Avx2Kernel:
+        stopped = boundaryAvx2(data, length, pos, finder);
+        break;
+#endif
+#if defined(SSE2_KERNEL)
+    case Sse2Kernel:
+        stopped = boundarySse2(data, length, pos, finder);
+        break;
+#endif
+    default:
+        break;
+    }
+    if (stopped)
+        return finder.found();
+    // Lines starting at pos or later, the newline before the first of them
+    // may be at pos - 1
+    size_t start = pos - 1;
+    while (start < length) {
+        const char *nl = static_cast<const char *>(memchr(data + start, '\n', length - start));
+        if (!nl)
+            break;
+        start = nl - data + 1;
+        if (finder(start))
+            break;
+    }
+    return finder.found();
+}
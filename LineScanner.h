@@ -0,0 +1,78 @@
+#ifndef LineScanner_h
+#define LineScanner_h
+
+#include <vector>
+#include <ctype.h>
+#include <stddef.h>
+#include <string.h>
+
+// What the start of a line means to the hunk state machine.
+enum LineKind {
+    HunkStartLine, // "--- " or a normal diff command like "5c5"
+    HeaderLine, // "+++ " or "@@ "
+    ChangeLine, // '+', '-', '<' or '>'
+    ContextLine, // ' '
+    OtherLine // anything else, ends the current hunk
+};
+
+// length is what's readable at data, which may extend past the end of the
+// line. None of the prefixes contain a newline so that doesn't matter.
+static inline LineKind classifyLine(const char *data, size_t length)
+{
+    if (!length)
+        return OtherLine;
+    switch (data[0]) {
+    case '-':
+        return length >= 4 && !memcmp(data, "--- ", 4) ? HunkStartLine : ChangeLine;
+    case '+':
+        return length >= 4 && !memcmp(data, "+++ ", 4) ? HeaderLine : ChangeLine;
+    case '@':
+        return length >= 3 && !memcmp(data, "@@ ", 3) ? HeaderLine : OtherLine;
+    case '<':
+    case '>':
+        return ChangeLine;
+    case ' ':
+        return ContextLine;
+    default:
+        return isdigit(static_cast<unsigned char>(data[0])) ? HunkStartLine : OtherLine;
+    }
+}
+
+// "\ No newline at end of file" is an OtherLine to classifyLine() but
+// belongs to the hunk it follows, in a --files section it doesn't end it
+static inline bool isNoNewlineMarker(const char *data, size_t length)
+{
+    return length && data[0] == '\\';
+}
+
+struct LineRecord
+{
+    size_t offset;
+    LineKind kind;
+};
+
+// Finds and classifies the lines in data in one vectorized pass. Appends a
+// record for every complete line followed by one more whose offset is the
+// end of the last complete line, so line i spans records[i].offset to
+// records[i + 1].offset. Unless last is true a trailing line without a
+// newline is left for the next call. Returns the number of bytes consumed.
+size_t scanLines(const char *data, size_t length, bool last, std::vector<LineRecord> &records);
+
+// Skips the rest of a file section's hunks in the same vectorized way,
+// without recording every line. data is the start of a line. Returns the
+// offset of the first line from there on that is a "--- " line or an
+// OtherLine other than a "\ No newline" marker, which starts the next
+// section, or length if there's none.
+size_t skipHunks(const char *data, size_t length);
+
+// The vector kernels are picked at runtime from what the CPU supports:
+// "scalar", "sse2", "avx2", "avx512" or "neon". setLineKernel() forces one
+// for benchmarking and testing and returns false if this CPU or build
+// doesn't have it.
+const char *lineKernel();
+bool setLineKernel(const char *name);
+// The names of all kernels, supported here or not, for i up to the count
+// and 0 after that
+const char *lineKernelName(size_t i);
+
+#endif
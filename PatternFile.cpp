@@ -0,0 +1,128 @@
+#include "PatternFile.h"
+#include "Hash.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char CacheMagic[8] = { 'h', 'u', 'n', 'k', 'p', 'c', '0', '2' };
+
+bool readPatternFile(const char *path, std::deque<std::string> &storage,
+                     std::vector<std::pair<char*, bool> > &input)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Can't open %s for reading\n", path);
+        return false;
+    }
+    std::vector<std::pair<char*, bool> > patterns;
+    std::string line;
+    size_t lineNumber = 0;
+    bool ok = true;
+    char buf[16384];
+    while (ok && fgets(buf, sizeof(buf), f)) {
+        line += buf;
+        if (line[line.size() - 1] != '\n' && !feof(f))
+            continue;
+        ++lineNumber;
+        if (line[line.size() - 1] == '\n')
+            line.resize(line.size() - 1);
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.resize(line.size() - 1);
+        if (!line.empty() && line[0] != '#') {
+            if (line[0] != '+' && line[0] != '-') {
+                fprintf(stderr, "%s:%zu: Patterns have to start with + or -\n", path, lineNumber);
+                ok = false;
+            } else {
+                storage.push_back(line.substr(1));
+                patterns.push_back(std::make_pair(&storage.back()[0], line[0] == '+'));
+            }
+        }
+        line.clear();
+    }
+    if (ferror(f)) {
+        fprintf(stderr, "Can't read %s\n", path);
+        ok = false;
+    }
+    fclose(f);
+    if (ok)
+        input.insert(input.end(), patterns.begin(), patterns.end());
+    return ok;
+}
+
+unsigned long long patternKey(const std::vector<std::pair<char*, bool> > &input, unsigned int flags)
+{
+    unsigned long long hash = fnv1a(&flags, sizeof(flags));
+    for (std::vector<std::pair<char*, bool> >::const_iterator it = input.begin(); it != input.end(); ++it) {
+        const char type = it->second ? '+' : '-';
+        hash = fnv1a(&type, 1, hash);
+        hash = fnv1a(it->first, strlen(it->first) + 1, hash);
+    }
+    return hash;
+}
+
+// The patterns and flags themselves, stored after the key so a hit is
+// known to be for the same patterns and not just for the same hash. The
+// file is only written once they have all compiled, so a hit also means
+// they're valid.
+static std::string patternRecord(const std::vector<std::pair<char*, bool> > &input, unsigned int flags)
+{
+    std::string record(reinterpret_cast<const char *>(&flags), sizeof(flags));
+    for (std::vector<std::pair<char*, bool> >::const_iterator it = input.begin(); it != input.end(); ++it) {
+        record += it->second ? '+' : '-';
+        record.append(it->first, strlen(it->first) + 1);
+    }
+    return record;
+}
+
+bool readPatternCache(const char *path, const std::vector<std::pair<char*, bool> > &input, unsigned int flags,
+                      std::string &compiled)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+    const std::string record = patternRecord(input, flags);
+    char magic[sizeof(CacheMagic)];
+    unsigned long long fileKey, recordLength;
+    bool ok = fread(magic, sizeof(magic), 1, f) == 1 && !memcmp(magic, CacheMagic, sizeof(magic))
+        && fread(&fileKey, sizeof(fileKey), 1, f) == 1 && fileKey == patternKey(input, flags)
+        && fread(&recordLength, sizeof(recordLength), 1, f) == 1 && recordLength == record.size();
+    if (ok) {
+        std::string fileRecord(record.size(), '\0');
+        ok = fread(&fileRecord[0], fileRecord.size(), 1, f) == 1 && fileRecord == record;
+    }
+    if (ok) {
+        compiled.clear();
+        char buf[65536];
+        size_t read;
+        while ((read = fread(buf, 1, sizeof(buf), f)))
+            compiled.append(buf, read);
+        ok = !ferror(f);
+    }
+    fclose(f);
+    return ok;
+}
+
+bool writePatternCache(const char *path, const std::vector<std::pair<char*, bool> > &input, unsigned int flags,
+                       const std::string &compiled)
+{
+    // Written next to the real one and renamed over it so concurrent runs
+    // never see half a cache.
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, static_cast<int>(getpid())) >= static_cast<int>(sizeof(tmp)))
+        return false;
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return false;
+    const unsigned long long key = patternKey(input, flags);
+    const std::string record = patternRecord(input, flags);
+    const unsigned long long recordLength = record.size();
+    bool ok = fwrite(CacheMagic, sizeof(CacheMagic), 1, f) == 1 && fwrite(&key, sizeof(key), 1, f) == 1
+        && fwrite(&recordLength, sizeof(recordLength), 1, f) == 1 && fwrite(record.c_str(), record.size(), 1, f) == 1
+        && (compiled.empty() || fwrite(compiled.c_str(), compiled.size(), 1, f) == 1);
+    ok = !fclose(f) && ok;
+    if (ok)
+        ok = !rename(tmp, path);
+    if (!ok)
+        unlink(tmp);
+    return ok;
+}
@@ -0,0 +1,29 @@
+#ifndef PatternFile_h
+#define PatternFile_h
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Reads a --patterns file, one pattern per line. "+pattern" keeps matching
+// hunks like --in, "-pattern" filters them out like --out. Empty lines and
+// lines starting with '#' are skipped. The patterns are kept in storage and
+// appended to input in the same form as the command line ones. Prints an
+// error and returns false if the file can't be read or has a bad line.
+bool readPatternFile(const char *path, std::deque<std::string> &storage,
+                     std::vector<std::pair<char*, bool> > &input);
+
+// Identifies a compiled pattern set by the patterns, in order, and flags
+unsigned long long patternKey(const std::vector<std::pair<char*, bool> > &input, unsigned int flags);
+
+// A --pattern-cache file holds the MatchSet::save() output for one set of
+// patterns and flags, and the patterns themselves. A file for any others,
+// or one that can't be read, is a miss. Only write one for patterns that
+// all compiled, a hit is taken to mean they did.
+bool readPatternCache(const char *path, const std::vector<std::pair<char*, bool> > &input, unsigned int flags,
+                      std::string &compiled);
+bool writePatternCache(const char *path, const std::vector<std::pair<char*, bool> > &input, unsigned int flags,
+                       const std::string &compiled);
+
+#endif
@@ -0,0 +1,252 @@
+#include "Predicates.h"
+#include "Hash.h"
+#include "Hunk.h"
+#include <ctype.h>
+
+enum { MaxPaths = 64 };
+
+static unsigned long long hashText(const char *data, size_t length, unsigned long long hash)
+{
+    for (size_t i=0; i<length; ++i) {
+        if (!isspace(static_cast<unsigned char>(data[i])))
+            hash = fnv1a(data + i, 1, hash);
+    }
+    return hash;
+}
+
+void HunkFacts::line(const char *data, size_t length, const Predicates &predicates)
+{
+    bytes += length;
+    int rank = 0;
+    size_t skip = 0;
+    switch (classifyLine(data, length)) {
+    case ChangeLine:
+        if (data[0] == '+' || data[0] == '>') {
+            ++added;
+            newText = hashText(data + 1, length - 1, newText);
+        } else {
+            ++removed;
+            oldText = hashText(data + 1, length - 1, oldText);
+        }
+        return;
+    case HunkStartLine:
+        if (data[0] == '-') {
+            rank = 2;
+            skip = 4;
+        }
+        break;
+    case HeaderLine:
+        if (data[0] == '+') {
+            rank = 3;
+            skip = 4;
+        }
+        break;
+    case OtherLine:
+        // Only --files sections start with one, their only name for binary
+        // files is on it
+        if (length > 11 && !memcmp(data, "diff --git ", 11)) {
+            const char *b = static_cast<const char *>(memmem(data, length, " b/", 3));
+            if (b) {
+                rank = 1;
+                skip = b + 1 - data;
+            }
+        }
+        break;
+    case ContextLine:
+        break;
+    }
+    if (rank < pathRank || !rank)
+        return;
+    const char *path = data + skip;
+    size_t pathLength = length - skip;
+    for (size_t i=0; i<pathLength; ++i) {
+        if (path[i] == '\t' || path[i] == '\n' || path[i] == '\r') {
+            pathLength = i;
+            break;
+        }
+    }
+    if (pathLength == 9 && !memcmp(path, "/dev/null", 9))
+        return;
+    if (pathLength > 2 && (path[0] == 'a' || path[0] == 'b') && path[1] == '/') {
+        path += 2;
+        pathLength -= 2;
+    }
+    pathRank = rank;
+    paths = predicates.matchPaths(path, pathLength);
+}
+
+Predicates::~Predicates()
+{
+    for (std::vector<Condition>::const_iterator it = mConditions.begin(); it != mConditions.end(); ++it)
+        delete it->path;
+}
+
+bool Predicates::add(const char *condition)
+{
+    mStorage.push_back(condition);
+    Condition c;
+    c.op = Equal;
+    c.value = 0;
+    c.negate = false;
+    c.path = 0;
+    c.bit = 0;
+    c.text = mStorage.back().c_str();
+    const char *name = condition;
+    if (*name == '!') {
+        c.negate = true;
+        ++name;
+    }
+    const char *end = name;
+    while (islower(static_cast<unsigned char>(*end)))
+        ++end;
+    const std::string field(name, end);
+    if (field == "whitespace" && !*end) {
+        c.field = Whitespace;
+        mConditions.push_back(c);
+        return true;
+    }
+    if (field == "path" && !c.negate) {
+        if (end[0] == '!' && end[1] == '~') {
+            c.negate = true;
+            ++end;
+        }
+        if (*end == '~' && end[1]) {
+            if (mPathCount == MaxPaths) {
+                fprintf(stderr, "Too many path conditions\n");
+                return false;
+            }
+            // The pattern's kept with the rest of the condition
+            mStorage.push_back(end + 1);
+            RegexpMatch *match = new RegexpMatch(Match::In, &mStorage.back()[0]);
+            if (!match->isValid()) {
+                delete match;
+                fprintf(stderr, "Invalid regexp %s\n", end + 1);
+                return false;
+            }
+            c.field = Path;
+            c.path = match;
+            c.bit = mPathCount++;
+            mConditions.push_back(c);
+            return true;
+        }
+    }
+    static const struct {
+        const char *name;
+        Op op;
+    } ops[] = {
+        { "<=", LessEqual },
+        { ">=", GreaterEqual },
+        { "==", Equal },
+        { "!=", NotEqual },
+        { "<", Less },
+        { ">", Greater }
+    };
+    bool op = false;
+    for (size_t i=0; i<sizeof(ops) / sizeof(ops[0]); ++i) {
+        const size_t length = strlen(ops[i].name);
+        if (!strncmp(end, ops[i].name, length)) {
+            c.op = ops[i].op;
+            end += length;
+            op = true;
+            break;
+        }
+    }
+    size_t value;
+    if (field == "added") {
+        c.field = Added;
+    } else if (field == "removed") {
+        c.field = Removed;
+    } else if (field == "changed") {
+        c.field = Changed;
+    } else if (field == "size") {
+        c.field = Size;
+    } else {
+        op = false;
+    }
+    if (!op || c.negate || !parseSize(end, &value)) {
+        fprintf(stderr, "Invalid condition %s\n", condition);
+        return false;
+    }
+    c.value = value;
+    mConditions.push_back(c);
+    return true;
+}
+
+bool Predicates::needsLines() const
+{
+    for (std::vector<Condition>::const_iterator it = mConditions.begin(); it != mConditions.end(); ++it) {
+        if (it->field != Path)
+            return true;
+    }
+    return false;
+}
+
+unsigned long long Predicates::key(unsigned long long seed) const
+{
+    for (std::vector<Condition>::const_iterator it = mConditions.begin(); it != mConditions.end(); ++it)
+        seed = fnv1a(it->text, strlen(it->text) + 1, seed);
+    return seed;
+}
+
+uint64_t Predicates::matchPaths(const char *path, size_t length) const
+{
+    uint64_t ret = 0;
+    for (std::vector<Condition>::const_iterator it = mConditions.begin(); it != mConditions.end(); ++it) {
+        if (it->field == Path && it->path->match(path, length))
+            ret |= static_cast<uint64_t>(1) << it->bit;
+    }
+    return ret;
+}
+
+const char *Predicates::failed(const HunkFacts &facts) const
+{
+    for (std::vector<Condition>::const_iterator it = mConditions.begin(); it != mConditions.end(); ++it) {
+        unsigned long long value = 0;
+        bool ok = true;
+        switch (it->field) {
+        case Added:
+            value = facts.added;
+            break;
+        case Removed:
+            value = facts.removed;
+            break;
+        case Changed:
+            value = facts.added + facts.removed;
+            break;
+        case Size:
+            value = facts.bytes;
+            break;
+        case Whitespace:
+            ok = facts.whitespaceOnly() != it->negate;
+            break;
+        case Path:
+            ok = ((facts.paths >> it->bit) & 1) != it->negate;
+            break;
+        }
+        if (it->field < Whitespace) {
+            switch (it->op) {
+            case Less:
+                ok = value < it->value;
+                break;
+            case LessEqual:
+                ok = value <= it->value;
+                break;
+            case Greater:
+                ok = value > it->value;
+                break;
+            case GreaterEqual:
+                ok = value >= it->value;
+                break;
+            case Equal:
+                ok = value == it->value;
+                break;
+            case NotEqual:
+                ok = value != it->value;
+                break;
+            }
+        }
+        if (!ok)
+            return it->text;
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+#ifndef Predicates_h
+#define Predicates_h
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+class Match;
+class Predicates;
+
+// What --where conditions look at, gathered line by line while a hunk is
+// evaluated. The path is the one a "+++ " line names, or for deleted files
+// the "--- " line, without an "a/" or "b/" prefix. Only path conditions are
+// decided then, on the spot, so the line doesn't have to be kept.
+struct HunkFacts
+{
+    HunkFacts()
+        : added(0), removed(0), bytes(0), oldText(TextSeed), newText(TextSeed), pathRank(0), paths(0)
+    {}
+
+    void line(const char *data, size_t length, const Predicates &predicates);
+
+    // The non-whitespace bytes on either side are the same, in order
+    bool whitespaceOnly() const { return (added || removed) && oldText == newText; }
+
+    // FNV-1a's own offset basis. From 0 a NUL byte would hash to 0 and a
+    // line of NULs would look like whitespace.
+    static const unsigned long long TextSeed = 0xcbf29ce484222325ULL;
+
+    size_t added, removed;
+    unsigned long long bytes;
+    // FNV-1a of the removed and the added lines with their whitespace left out
+    unsigned long long oldText, newText;
+    // Which line the path came from, a later kind overrides an earlier one
+    int pathRank;
+    // A bit per path condition
+    uint64_t paths;
+};
+
+// The --where conditions, which a hunk has to meet on top of being kept by
+// the patterns:
+//   added, removed, changed (both) or size (bytes) compared with <, <=, >,
+//   >=, == or != to a number, size takes k/m/g suffixes
+//   whitespace or !whitespace, for hunks that only change whitespace
+//   path~regexp or path!~regexp
+class Predicates
+{
+public:
+    Predicates()
+        : mPathCount(0)
+    {}
+    ~Predicates();
+
+    // Prints why and returns false for a condition that can't be parsed
+    bool add(const char *condition);
+
+    bool empty() const { return mConditions.empty(); }
+    // False if every condition is about the path, the only thing there is
+    // to go on with --files
+    bool needsLines() const;
+    // Identifies the conditions, for cache keys
+    unsigned long long key(unsigned long long seed) const;
+
+    // The first condition facts fail, 0 if they meet all of them
+    const char *failed(const HunkFacts &facts) const;
+
+    // Sets the bits of the path conditions path matches
+    uint64_t matchPaths(const char *path, size_t length) const;
+
+private:
+    enum Field {
+        Added,
+        Removed,
+        Changed,
+        Size,
+        Whitespace,
+        Path
+    };
+
+    enum Op {
+        Less,
+        LessEqual,
+        Greater,
+        GreaterEqual,
+        Equal,
+        NotEqual
+    };
+
+    struct Condition
+    {
+        Field field;
+        Op op;
+        unsigned long long value;
+        bool negate;
+        Match *path;
+        size_t bit;
+        const char *text;
+    };
+
+    std::deque<std::string> mStorage;
+    std::vector<Condition> mConditions;
+    size_t mPathCount;
+
+    Predicates(const Predicates &);
+    Predicates &operator=(const Predicates &);
+};
+
+#endif
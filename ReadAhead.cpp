@@ -0,0 +1,372 @@
+#include "ReadAhead.h"
+#include "Compression.h"
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+enum {
+    BlockSize = 1024 * 1024,
+    BlockCount = 4
+};
+
+#ifdef HAVE_IO_URING
+// Just enough of io_uring to queue reads and wait for them, without liburing
+class Ring
+{
+public:
+    Ring()
+        : mFd(-1), mSq(MAP_FAILED), mCq(MAP_FAILED), mSqes(MAP_FAILED), mSqLength(0), mCqLength(0),
+          mSqesLength(0)
+    {}
+
+    ~Ring()
+    {
+        if (mSqes != MAP_FAILED)
+            munmap(mSqes, mSqesLength);
+        if (mCq != MAP_FAILED && mCq != mSq)
+            munmap(mCq, mCqLength);
+        if (mSq != MAP_FAILED)
+            munmap(mSq, mSqLength);
+        if (mFd != -1)
+            close(mFd);
+    }
+
+    bool open(unsigned int entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        mFd = syscall(__NR_io_uring_setup, entries, &params);
+        // Reads at the current position, which pipes need, came with
+        // IORING_OP_READ itself
+        if (mFd == -1 || !(params.features & IORING_FEAT_RW_CUR_POS))
+            return false;
+        mSqLength = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        mCqLength = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            mSqLength = mCqLength = std::max(mSqLength, mCqLength);
+        mSq = mmap(0, mSqLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+        if (mSq == MAP_FAILED)
+            return false;
+        mCq = single ? mSq : mmap(0, mCqLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd,
+                                  IORING_OFF_CQ_RING);
+        if (mCq == MAP_FAILED)
+            return false;
+        mSqesLength = params.sq_entries * sizeof(io_uring_sqe);
+        mSqes = mmap(0, mSqesLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQES);
+        if (mSqes == MAP_FAILED)
+            return false;
+        char *sq = static_cast<char *>(mSq), *cq = static_cast<char *>(mCq);
+        mSqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        mSqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        mSqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        mCqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        mCqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        mCqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        mCqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // An offset of -1 reads from the current position
+    bool read(int fd, char *data, size_t length, uint64_t offset, uint64_t tag)
+    {
+        io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uintptr_t>(data);
+        sqe.len = length;
+        sqe.off = offset;
+        sqe.user_data = tag;
+        return submit(sqe);
+    }
+
+    // The cancellation completes with a tag of its own
+    bool cancel(uint64_t tag, uint64_t cancelTag)
+    {
+        io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.fd = -1;
+        sqe.addr = tag;
+        sqe.user_data = cancelTag;
+        return submit(sqe);
+    }
+
+    bool wait(uint64_t *tag, int *result)
+    {
+        while (true) {
+            const unsigned head = *mCqHead;
+            if (head != __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE)) {
+                const io_uring_cqe &cqe = mCqes[head & mCqMask];
+                *tag = cqe.user_data;
+                *result = cqe.res;
+                __atomic_store_n(mCqHead, head + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+            if (syscall(__NR_io_uring_enter, mFd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) == -1 && errno != EINTR)
+                return false;
+        }
+    }
+
+private:
+    // Only ever called from one thread, and never with more requests in
+    // flight than the ring has entries
+    bool submit(const io_uring_sqe &sqe)
+    {
+        const unsigned tail = *mSqTail;
+        const unsigned idx = tail & mSqMask;
+        static_cast<io_uring_sqe *>(mSqes)[idx] = sqe;
+        mSqArray[idx] = idx;
+        __atomic_store_n(mSqTail, tail + 1, __ATOMIC_RELEASE);
+        int r;
+        do {
+            r = syscall(__NR_io_uring_enter, mFd, 1, 0, 0, 0, 0);
+        } while (r == -1 && errno == EINTR);
+        return r == 1;
+    }
+
+    int mFd;
+    void *mSq, *mCq, *mSqes;
+    size_t mSqLength, mCqLength, mSqesLength;
+    unsigned *mSqTail, *mSqArray, *mCqHead, *mCqTail;
+    unsigned mSqMask, mCqMask;
+    io_uring_cqe *mCqes;
+};
+#endif
+
+struct ReadAhead::Data
+{
+    Data(int f, const char *h, size_t headLength)
+        : fd(f), head(h, headLength), headDone(false), seekable(false), offset(0), slotCount(0),
+          current(None), upcoming(0), inFlight(0), ended(false)
+    {}
+
+    enum {
+        None = ~static_cast<size_t>(0),
+        CancelTag = ~static_cast<uint64_t>(0)
+    };
+
+    enum State {
+        Idle,
+        Reading,
+        Done
+    };
+
+    struct Slot
+    {
+        Slot()
+            : data(BlockSize), state(Idle), offset(0), result(0)
+        {}
+
+        std::vector<char> data;
+        State state;
+        uint64_t offset;
+        int result;
+    };
+
+#ifdef HAVE_IO_URING
+    bool start()
+    {
+        if (!ring.open(BlockCount * 2))
+            return false;
+        // Pipes have to be read in order, one read at a time. Files are
+        // read at their own offsets, as far ahead as there are blocks.
+        const off_t position = lseek(fd, 0, SEEK_CUR);
+        seekable = position != -1;
+        offset = seekable ? position : 0;
+        slotCount = seekable ? BlockCount : 2;
+        slots.resize(slotCount);
+        if (seekable) {
+            for (size_t i=0; i<slotCount; ++i) {
+                if (!queue(i, offset))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    bool queue(size_t idx, uint64_t at)
+    {
+        Slot &slot = slots[idx];
+        if (!ring.read(fd, &slot.data[0], slot.data.size(), seekable ? at : ~static_cast<uint64_t>(0), idx)) {
+            error = "Can't queue read";
+            ended = true;
+            return false;
+        }
+        slot.state = Reading;
+        slot.offset = at;
+        if (seekable && at == offset)
+            offset += slot.data.size();
+        ++inFlight;
+        return true;
+    }
+
+    // Waits until slot idx has been read
+    bool await(size_t idx)
+    {
+        while (slots[idx].state == Reading) {
+            uint64_t tag;
+            int result;
+            if (!ring.wait(&tag, &result)) {
+                error = strerror(errno);
+                return false;
+            }
+            if (tag == CancelTag)
+                continue;
+            --inFlight;
+            Slot &slot = slots[tag];
+            if (result == -EINTR || result == -EAGAIN) {
+                if (!queue(tag, slot.offset))
+                    return false;
+                continue;
+            }
+            slot.state = Done;
+            slot.result = result;
+        }
+        return true;
+    }
+
+    // After a short read the reads queued behind it are at the wrong
+    // offsets and are done again
+    bool requeueAfter(size_t idx)
+    {
+        for (size_t i=1; i<slotCount; ++i) {
+            const size_t other = (idx + i) % slotCount;
+            if (!await(other))
+                return false;
+            slots[other].state = Idle;
+        }
+        offset = slots[idx].offset + slots[idx].result;
+        for (size_t i=1; i<slotCount; ++i) {
+            if (!queue((idx + i) % slotCount, offset))
+                return false;
+        }
+        return true;
+    }
+
+    bool nextSlot(const char *&data, size_t &length)
+    {
+        if (current != None) {
+            slots[current].state = Idle;
+            if (seekable && !queue(current, offset))
+                return false;
+            current = None;
+        }
+        const size_t idx = upcoming;
+        if (slots[idx].state == Idle && !queue(idx, offset))
+            return false;
+        if (!await(idx)) {
+            ended = true;
+            return false;
+        }
+        Slot &slot = slots[idx];
+        if (slot.result <= 0) {
+            if (slot.result < 0)
+                error = strerror(-slot.result);
+            slot.state = Idle;
+            ended = true;
+            return false;
+        }
+        if (seekable && static_cast<size_t>(slot.result) < slot.data.size() && !requeueAfter(idx))
+            return false;
+        current = idx;
+        upcoming = (idx + 1) % slotCount;
+        if (!seekable && !queue(upcoming, 0))
+            return false;
+        data = &slot.data[0];
+        length = slot.result;
+        return true;
+    }
+
+    // The kernel may still be writing to the blocks
+    void cancel()
+    {
+        for (size_t i=0; i<slotCount; ++i) {
+            if (slots[i].state == Reading)
+                ring.cancel(i, CancelTag);
+        }
+        while (inFlight) {
+            uint64_t tag;
+            int result;
+            if (!ring.wait(&tag, &result))
+                break;
+            if (tag != CancelTag)
+                --inFlight;
+        }
+    }
+
+    Ring ring;
+#endif
+
+    const int fd;
+    const std::string head;
+    bool headDone;
+    std::unique_ptr<Decompressor> thread;
+    std::vector<Slot> slots;
+    bool seekable;
+    uint64_t offset;
+    size_t slotCount, current, upcoming, inFlight;
+    bool ended;
+    std::string error;
+};
+
+ReadAhead::ReadAhead(int fd, const char *head, size_t headLength)
+    : mData(new Data(fd, head, headLength))
+{
+#ifdef HAVE_IO_URING
+    if (mData->start())
+        return;
+    mData->cancel();
+    mData->slots.clear();
+    mData->error.clear();
+    mData->ended = false;
+#endif
+    mData->thread.reset(new Decompressor(Uncompressed, fd, head, headLength));
+}
+
+ReadAhead::~ReadAhead()
+{
+#ifdef HAVE_IO_URING
+    if (!mData->thread)
+        mData->cancel();
+#endif
+    delete mData;
+}
+
+bool ReadAhead::next(const char *&data, size_t &length)
+{
+    if (mData->thread)
+        return mData->thread->next(data, length);
+#ifdef HAVE_IO_URING
+    if (!mData->headDone) {
+        mData->headDone = true;
+        if (!mData->head.empty()) {
+            data = mData->head.data();
+            length = mData->head.size();
+            return true;
+        }
+    }
+    if (mData->ended)
+        return false;
+    return mData->nextSlot(data, length);
+#else
+    return false;
+#endif
+}
+
+const char *ReadAhead::error() const
+{
+    if (mData->thread)
+        return mData->thread->error();
+    return mData->error.empty() ? 0 : mData->error.c_str();
+}
@@ -0,0 +1,30 @@
+#ifndef ReadAhead_h
+#define ReadAhead_h
+
+#include "BlockSource.h"
+
+// Reads a descriptor a few blocks ahead of whoever is parsing it. With
+// io_uring the reads are queued in the kernel, several at once at their own
+// offsets for files and one at a time for pipes. Without it, or where it
+// isn't allowed, a thread does the reading.
+class ReadAhead : public BlockSource
+{
+public:
+    // head is what has already been read from fd
+    ReadAhead(int fd, const char *head, size_t headLength);
+    virtual ~ReadAhead();
+
+    virtual bool next(const char *&data, size_t &length);
+
+    // Why the input ended early, 0 if it didn't
+    const char *error() const;
+
+private:
+    ReadAhead(const ReadAhead &);
+    ReadAhead &operator=(const ReadAhead &);
+
+    struct Data;
+    Data *mData;
+};
+
+#endif
@@ -0,0 +1,451 @@
+#include "RegexSet.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#ifdef HAVE_RE2
+#include <re2/re2.h>
+#include <re2/set.h>
+
+static void appendLiteral(std::string &out, unsigned char ch)
+{
+    if (isalnum(ch) || ch == ' ' || ch == '_') {
+        out += ch;
+    } else if (ch < 0x20 || ch >= 0x7f) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "\\x{%02x}", ch);
+        out += buf;
+    } else {
+        out += '\\';
+        out += ch;
+    }
+}
+
+// Parses a bracket expression starting after the '['. Returns the position
+// after the closing ']' or 0 if it uses something we don't translate.
+static const char *translateBracket(const char *p, std::string &out)
+{
+    out += '[';
+    if (*p == '^') {
+        out += '^';
+        ++p;
+    }
+    bool first = true;
+    while (*p && (first || *p != ']')) {
+        first = false;
+        if (*p == '[' && (p[1] == '=' || p[1] == '.'))
+            return 0;
+        if (*p == '[' && p[1] == ':') {
+            const char *end = strstr(p + 2, ":]");
+            if (!end)
+                return 0;
+            out.append(p, end + 2);
+            p = end + 2;
+            continue;
+        }
+        appendLiteral(out, *p);
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            if (p[2] == '[')
+                return 0;
+            out += '-';
+            appendLiteral(out, p[2]);
+            p += 3;
+        } else {
+            ++p;
+        }
+    }
+    if (*p != ']')
+        return 0;
+    out += ']';
+    return p + 1;
+}
+
+// Rewrites a GNU basic regexp in RE2 syntax. Returns false for constructs
+// that RE2 can't express the same way.
+static bool translate(const char *pattern, std::string &out)
+{
+    // atStart: '^' is an anchor here. literalStar: '*' is a literal here,
+    // which is also the case right after a '^' anchor. repeatable: the
+    // previous token is an atom that a repetition operator can apply to.
+    // Repeating anything else (an assertion, another repetition) means
+    // something different in RE2, so those patterns are left to regexec.
+    bool atStart = true;
+    bool literalStar = true;
+    bool repeatable = false;
+    const char *p = pattern;
+    while (*p) {
+        const bool wasStart = atStart;
+        const bool wasLiteralStar = literalStar;
+        const bool wasRepeatable = repeatable;
+        atStart = literalStar = false;
+        repeatable = true;
+        switch (*p) {
+        case '\\':
+            ++p;
+            switch (*p) {
+            case '\0':
+                return false;
+            case '(':
+                out += '(';
+                atStart = literalStar = true;
+                repeatable = false;
+                break;
+            case ')':
+                out += ')';
+                break;
+            case '|':
+                out += '|';
+                atStart = literalStar = true;
+                repeatable = false;
+                break;
+            case '{': {
+                // Only plain {m}, {m,} and {m,n}; RE2 would read anything
+                // else as literal text instead of rejecting it.
+                const char *end = strstr(p, "\\}");
+                if (!wasRepeatable || !end || end == p + 1)
+                    return false;
+                for (const char *ch = p + 1; ch != end; ++ch) {
+                    if (!isdigit(static_cast<unsigned char>(*ch)) && *ch != ',')
+                        return false;
+                }
+                out += p[1] == ',' ? "{0" : "{";
+                out.append(p + 1, end);
+                out += '}';
+                p = end + 1;
+                repeatable = false;
+                break; }
+            case '+':
+            case '?':
+                if (!wasRepeatable)
+                    return false;
+                out += *p;
+                repeatable = false;
+                break;
+            case 'b':
+            case 'B':
+                out += '\\';
+                out += *p;
+                repeatable = false;
+                break;
+            case '`':
+                out += "\\A";
+                repeatable = false;
+                break;
+            case '\'':
+                out += "\\z";
+                repeatable = false;
+                break;
+            case 'w':
+                out += "[[:alnum:]_]";
+                break;
+            case 'W':
+                out += "[^[:alnum:]_]";
+                break;
+            case 's':
+                out += "[[:space:]]";
+                break;
+            case 'S':
+                out += "[^[:space:]]";
+                break;
+            default:
+                if (isdigit(static_cast<unsigned char>(*p)) || *p == '<' || *p == '>')
+                    return false;
+                appendLiteral(out, *p);
+                break;
+            }
+            ++p;
+            break;
+        case '[':
+            p = translateBracket(p + 1, out);
+            if (!p)
+                return false;
+            break;
+        case '.':
+            // regexec's '.' doesn't match NUL, RE2's does
+            out += "[^\\x00]";
+            ++p;
+            break;
+        case '*':
+            if (wasLiteralStar) {
+                out += "\\*";
+            } else if (wasRepeatable) {
+                out += '*';
+                repeatable = false;
+            } else {
+                return false;
+            }
+            ++p;
+            break;
+        case '^':
+            if (wasStart) {
+                out += '^';
+                literalStar = true;
+                repeatable = false;
+            } else {
+                out += "\\^";
+            }
+            ++p;
+            break;
+        case '$':
+            if (!p[1] || (p[1] == '\\' && (p[2] == ')' || p[2] == '|'))) {
+                out += '$';
+                repeatable = false;
+            } else {
+                out += "\\$";
+            }
+            ++p;
+            break;
+        default:
+            appendLiteral(out, *p++);
+            break;
+        }
+    }
+    return true;
+}
+
+struct RegexSet::Data
+{
+    Data()
+        : set(options(), RE2::UNANCHORED)
+    {}
+
+    static RE2::Options options()
+    {
+        // Latin-1 makes RE2 work on bytes like regexec does in the C
+        // locale, and without REG_NEWLINE '.' matches '\n' too.
+        RE2::Options ret;
+        ret.set_encoding(RE2::Options::EncodingLatin1);
+        ret.set_dot_nl(true);
+        ret.set_log_errors(false);
+        ret.set_max_mem(64 << 20);
+        return ret;
+    }
+
+    RE2::Set set;
+    std::vector<size_t> indexes;
+};
+
+RegexSet::RegexSet()
+    : mData(new Data)
+{}
+
+RegexSet::~RegexSet()
+{
+    delete mData;
+}
+
+bool RegexSet::add(const char *pattern, size_t index)
+{
+    std::string translated;
+    if (!translate(pattern, translated) || mData->set.Add(translated, 0) == -1)
+        return false;
+    mData->indexes.push_back(index);
+    return true;
+}
+
+bool RegexSet::compile()
+{
+    if (mData->indexes.empty() || mData->set.Compile())
+        return true;
+    // Past the memory limit, the set is left empty
+    mData->indexes.clear();
+    return false;
+}
+
+bool RegexSet::match(const char *data, size_t length, size_t limit, size_t *result) const
+{
+    *result = limit;
+    if (mData->indexes.empty() || !limit)
+        return true;
+    std::vector<int> matched;
+    RE2::Set::ErrorInfo error;
+    if (!mData->set.Match(re2::StringPiece(data, length), &matched, &error))
+        return error.kind == RE2::Set::kNoError;
+    for (std::vector<int>::const_iterator it = matched.begin(); it != matched.end(); ++it) {
+        const size_t index = mData->indexes[*it];
+        if (index < *result)
+            *result = index;
+    }
+    return true;
+}
+
+bool RegexSet::empty() const
+{
+    return mData->indexes.empty();
+}
+
+#else
+
+struct RegexSet::Data
+{
+};
+
+RegexSet::RegexSet()
+    : mData(0)
+{}
+
+RegexSet::~RegexSet()
+{}
+
+bool RegexSet::add(const char *, size_t)
+{
+    return false;
+}
+
+bool RegexSet::compile()
+{
+    return true;
+}
+
+bool RegexSet::match(const char *, size_t, size_t limit, size_t *result) const
+{
+    *result = limit;
+    return true;
+}
+
+bool RegexSet::empty() const
+{
+    return true;
+}
+
+#endif
+
+// Skips a bracket expression starting after the '['. Returns the position
+// after the closing ']' or 0 if there isn't one.
+static const char *skipBracket(const char *p)
+{
+    if (*p == '^')
+        ++p;
+    if (*p == ']')
+        ++p;
+    while (*p && *p != ']') {
+        if (*p == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.')) {
+            const char close[] = { p[1], ']', '\0' };
+            const char *end = strstr(p + 2, close);
+            if (!end)
+                return 0;
+            p = end + 2;
+        } else {
+            ++p;
+        }
+    }
+    return *p ? p + 1 : 0;
+}
+
+std::string requiredLiteral(const char *pattern)
+{
+    // Same parse as translate(). Only literals outside of groups count as
+    // each group may be repeated or be one side of an alternation, and an
+    // alternation outside of a group means nothing is required at all. A
+    // literal followed by a repetition is optional, so it's dropped and
+    // ends the run.
+    std::string best, run;
+    bool atStart = true;
+    bool literalStar = true;
+    bool inRun = false;
+    int depth = 0;
+    const char *p = pattern;
+    while (*p) {
+        const bool wasStart = atStart;
+        const bool wasLiteralStar = literalStar;
+        const bool wasInRun = inRun;
+        atStart = literalStar = inRun = false;
+        bool literal = false, repetition = false;
+        char ch = 0;
+        switch (*p) {
+        case '\\':
+            ++p;
+            switch (*p) {
+            case '\0':
+                return std::string();
+            case '(':
+                ++depth;
+                atStart = literalStar = true;
+                break;
+            case ')':
+                if (!depth)
+                    return std::string();
+                --depth;
+                break;
+            case '|':
+                if (!depth)
+                    return std::string();
+                atStart = literalStar = true;
+                break;
+            case '{':
+                p = strstr(p, "\\}");
+                if (!p)
+                    return std::string();
+                ++p;
+                repetition = true;
+                break;
+            case '+':
+            case '?':
+                repetition = true;
+                break;
+            case 'b': case 'B': case '`': case '\'': case '<': case '>':
+            case 'w': case 'W': case 's': case 'S':
+                break;
+            default:
+                if (isdigit(static_cast<unsigned char>(*p)))
+                    break;
+                literal = true;
+                ch = *p;
+                break;
+            }
+            ++p;
+            break;
+        case '[':
+            p = skipBracket(p + 1);
+            if (!p)
+                return std::string();
+            break;
+        case '*':
+            if (wasLiteralStar) {
+                literal = true;
+                ch = '*';
+            } else {
+                repetition = true;
+            }
+            ++p;
+            break;
+        case '^':
+            if (wasStart) {
+                literalStar = true;
+            } else {
+                literal = true;
+                ch = '^';
+            }
+            ++p;
+            break;
+        case '$':
+            if (p[1] && !(p[1] == '\\' && (p[2] == ')' || p[2] == '|'))) {
+                literal = true;
+                ch = '$';
+            }
+            ++p;
+            break;
+        case '.':
+            ++p;
+            break;
+        default:
+            literal = true;
+            ch = *p++;
+            break;
+        }
+        if (repetition && wasInRun)
+            run.resize(run.size() - 1);
+        if (literal && !depth) {
+            run += ch;
+            inRun = true;
+        } else {
+            if (run.size() > best.size())
+                best = run;
+            run.clear();
+        }
+    }
+    if (run.size() > best.size())
+        best = run;
+    return best;
+}
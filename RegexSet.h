@@ -0,0 +1,45 @@
+#ifndef RegexSet_h
+#define RegexSet_h
+
+#include <string>
+#include <stddef.h>
+
+// Matches a set of regexps in a single linear-time pass. Patterns are POSIX
+// basic regexps as understood by regcomp(3). Patterns that can't be
+// expressed by the underlying engine (back references, \< and \>, ...) are
+// rejected by add() and have to be matched by the caller. Without RE2 every
+// pattern is rejected.
+class RegexSet
+{
+public:
+    RegexSet();
+    ~RegexSet();
+
+    bool add(const char *pattern, size_t index);
+    // Returns false if the set would take too much memory, it's empty then
+    // and every pattern has to be matched by the caller.
+    bool compile();
+
+    // Stores the lowest index of a pattern that matches data, or limit if
+    // none of the patterns below limit do, in *result. Returns false if the
+    // engine gave up on this input, in which case the caller has to fall
+    // back to matching the patterns one by one.
+    bool match(const char *data, size_t length, size_t limit, size_t *result) const;
+
+    bool empty() const;
+
+private:
+    RegexSet(const RegexSet &);
+    RegexSet &operator=(const RegexSet &);
+
+    struct Data;
+    Data *mData;
+};
+
+// Returns the longest literal that every match of the basic regexp pattern
+// contains, or an empty string if there's no such literal or the pattern
+// isn't understood. Lines without it can be skipped without running the
+// regexp.
+std::string requiredLiteral(const char *pattern);
+
+#endif
@@ -0,0 +1,489 @@
+#include "Server.h"
+#include "Compression.h"
+#include "Hash.h"
+#include "HunkFilter.h"
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+std::string PatternSet::hashName() const
+{
+    unsigned long long hash = fnv1a(&flags, sizeof(flags));
+    for (std::vector<std::string>::const_iterator it = patterns.begin(); it != patterns.end(); ++it)
+        hash = fnv1a(it->c_str(), it->size() + 1, hash);
+    char buf[64];
+    snprintf(buf, sizeof(buf), "anon-%016llx", hash);
+    return buf;
+}
+
+// What one client can make the server hold on to
+enum {
+    MaxSets = 256, // Least recently used sets beyond this are forgotten
+    MaxPatterns = 4096,
+    MaxPatternBytes = 1024 * 1024, // Of all patterns in a set together
+    MaxLine = 64 * 1024,
+    MaxFilterBytes = 256 * 1024 * 1024,
+    MaxClients = 8 // Served at once, others wait to be accepted
+};
+
+// Buffered reads and full writes on a socket
+class Connection
+{
+public:
+    Connection(int fd)
+        : mFd(fd), mPos(0)
+    {}
+
+    ~Connection()
+    {
+        close(mFd);
+    }
+
+    // Fails for lines longer than limit as well
+    bool readLine(std::string &line, size_t limit = MaxLine)
+    {
+        // What's after mPos has been searched up to here
+        size_t searched = 0;
+        while (true) {
+            const size_t newline = mBuffer.find('\n', mPos + searched);
+            if (newline != std::string::npos) {
+                if (newline - mPos > limit)
+                    return false;
+                line.assign(mBuffer, mPos, newline - mPos);
+                mPos = newline + 1;
+                return true;
+            }
+            searched = mBuffer.size() - mPos;
+            if (searched > limit || !fill())
+                return false;
+        }
+    }
+
+    bool read(size_t length, std::string &data)
+    {
+        data.assign(mBuffer, mPos, std::min(length, mBuffer.size() - mPos));
+        mPos += data.size();
+        while (data.size() < length) {
+            char buf[65536];
+            const ssize_t r = ::read(mFd, buf, std::min(sizeof(buf), length - data.size()));
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                return false;
+            data.append(buf, r);
+        }
+        return true;
+    }
+
+    bool write(const char *data, size_t length)
+    {
+        while (length) {
+            const ssize_t w = ::write(mFd, data, length);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                return false;
+            data += w;
+            length -= w;
+        }
+        return true;
+    }
+
+    bool write(const std::string &data)
+    {
+        return write(data.c_str(), data.size());
+    }
+
+private:
+    bool fill()
+    {
+        mBuffer.erase(0, mPos);
+        mPos = 0;
+        char buf[65536];
+        while (true) {
+            const ssize_t r = ::read(mFd, buf, sizeof(buf));
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                return false;
+            mBuffer.append(buf, r);
+            return true;
+        }
+    }
+
+    const int mFd;
+    std::string mBuffer;
+    size_t mPos;
+};
+
+// Splits a request line into its words
+static std::vector<std::string> split(const std::string &line)
+{
+    std::vector<std::string> words;
+    size_t pos = 0;
+    while (pos < line.size()) {
+        const size_t space = line.find(' ', pos);
+        const size_t end = space == std::string::npos ? line.size() : space;
+        if (end > pos)
+            words.push_back(line.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return words;
+}
+
+static bool parseCount(const std::string &word, unsigned long long *count)
+{
+    char *end;
+    *count = strtoull(word.c_str(), &end, 10);
+    return !word.empty() && !*end;
+}
+
+class Server
+{
+public:
+    Server()
+        : mClock(0), mClients(0)
+    {}
+
+    // Waits until another client can be served
+    void admit()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (mClients >= MaxClients)
+            mDone.wait(lock);
+        ++mClients;
+    }
+
+    // Serves an admitted client
+    void run(int fd)
+    {
+        serve(fd);
+        std::lock_guard<std::mutex> lock(mMutex);
+        --mClients;
+        mDone.notify_one();
+    }
+
+    bool define(const std::string &name, const PatternSet &set, std::string &error)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            std::map<std::string, Entry>::iterator it = mSets.find(name);
+            if (it != mSets.end() && it->second.set.flags == set.flags && it->second.set.patterns == set.patterns) {
+                it->second.used = ++mClock;
+                return true;
+            }
+        }
+        std::shared_ptr<HunkFilter> filter(new HunkFilter(set.flags));
+        for (std::vector<std::string>::const_iterator it = set.patterns.begin(); it != set.patterns.end(); ++it) {
+            const char *pattern = it->c_str() + 1;
+            if (!((*it)[0] == '+' ? filter->addIn(pattern) : filter->addOut(pattern))) {
+                error = "Invalid regexp ";
+                error += pattern;
+                return false;
+            }
+        }
+        // Filtering nothing compiles the set, so the first real request
+        // doesn't have to
+        std::string ignored;
+        filter->filter(0, 0, ignored);
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mSets.find(name) == mSets.end() && mSets.size() >= MaxSets)
+            evict();
+        Entry &entry = mSets[name];
+        entry.set = set;
+        entry.filter = filter;
+        entry.used = ++mClock;
+        return true;
+    }
+
+    std::shared_ptr<HunkFilter> find(const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::map<std::string, Entry>::iterator it = mSets.find(name);
+        if (it == mSets.end())
+            return std::shared_ptr<HunkFilter>();
+        it->second.used = ++mClock;
+        return it->second.filter;
+    }
+
+    void serve(int fd)
+    {
+        Connection connection(fd);
+        std::string line, data, error;
+        while (connection.readLine(line)) {
+            const std::vector<std::string> words = split(line);
+            unsigned long long flags, count;
+            if (words.size() == 4 && words[0] == "DEFINE" && parseCount(words[2], &flags)
+                && parseCount(words[3], &count)) {
+                if (count > MaxPatterns) {
+                    connection.write("ERR Too many patterns\n");
+                    return;
+                }
+                PatternSet set;
+                set.flags = flags;
+                size_t bytes = 0;
+                for (unsigned long long i=0; i<count; ++i) {
+                    if (!connection.readLine(line) || (bytes += line.size()) > MaxPatternBytes) {
+                        connection.write("ERR Patterns too long\n");
+                        return;
+                    }
+                    if (line.empty() || (line[0] != '+' && line[0] != '-')) {
+                        connection.write("ERR Invalid pattern line\n");
+                        return;
+                    }
+                    set.patterns.push_back(line);
+                }
+                if (!define(words[1], set, error)) {
+                    connection.write("ERR " + error + "\n");
+                } else if (!connection.write("OK\n")) {
+                    return;
+                }
+            } else if (words.size() == 3 && words[0] == "FILTER" && parseCount(words[2], &count)) {
+                if (count > MaxFilterBytes) {
+                    connection.write("ERR Diff too large\n");
+                    return;
+                }
+                if (!connection.read(count, data))
+                    return;
+                const std::shared_ptr<HunkFilter> filter = find(words[1]);
+                if (!filter) {
+                    if (!connection.write("ERR Unknown pattern set " + words[1] + "\n"))
+                        return;
+                    continue;
+                }
+                std::string out;
+                filter->filter(data.c_str(), data.size(), out);
+                char buf[64];
+                snprintf(buf, sizeof(buf), "OK %zu\n", out.size());
+                if (!connection.write(buf) || !connection.write(out))
+                    return;
+            } else {
+                connection.write("ERR Invalid request\n");
+                return;
+            }
+        }
+    }
+
+private:
+    struct Entry
+    {
+        PatternSet set;
+        std::shared_ptr<HunkFilter> filter;
+        unsigned long long used;
+    };
+
+    // Forgets the least recently used set. The one given on the command
+    // line stays, it's what clients without patterns of their own use.
+    void evict()
+    {
+        std::map<std::string, Entry>::iterator oldest = mSets.end();
+        for (std::map<std::string, Entry>::iterator it = mSets.begin(); it != mSets.end(); ++it) {
+            if (it->first != "default" && (oldest == mSets.end() || it->second.used < oldest->second.used))
+                oldest = it;
+        }
+        if (oldest != mSets.end())
+            mSets.erase(oldest);
+    }
+
+    std::mutex mMutex;
+    unsigned long long mClock;
+    std::map<std::string, Entry> mSets;
+    size_t mClients;
+    std::condition_variable mDone;
+};
+
+static bool socketAddress(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+int runServer(const char *path, const PatternSet &defaults)
+{
+    struct sockaddr_un addr;
+    if (!socketAddress(path, &addr))
+        return 1;
+    signal(SIGPIPE, SIG_IGN);
+    Server server;
+    std::string error;
+    if (!defaults.patterns.empty() && !server.define("default", defaults, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 3;
+    }
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        fprintf(stderr, "Can't create socket: %s\n", strerror(errno));
+        return 2;
+    }
+    unlink(path);
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) || listen(fd, 64)) {
+        fprintf(stderr, "Can't listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return 2;
+    }
+    while (true) {
+        const int client = accept(fd, 0, 0);
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+                continue;
+            fprintf(stderr, "Can't accept on %s: %s\n", path, strerror(errno));
+            close(fd);
+            return 2;
+        }
+        // Clients beyond MaxClients wait here, unread, and the rest in the
+        // listen backlog
+        server.admit();
+        std::thread(&Server::run, &server, client).detach();
+    }
+}
+
+static bool readAll(int fd, std::string &data)
+{
+    char buf[65536];
+    while (true) {
+        const ssize_t r = read(fd, buf, sizeof(buf));
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return false;
+        if (!r)
+            return true;
+        data.append(buf, r);
+    }
+}
+
+// The server only filters plain diffs, so compressed input is decompressed
+// here. That also keeps the server's size limit on what it has to hold.
+static bool decompress(std::string &data, std::string &error)
+{
+    const Compression compression = detectCompression(data.c_str(), data.size());
+    if (compression == Uncompressed)
+        return true;
+    std::string plain;
+    {
+        Decompressor decompressor(compression, data.c_str(), data.size());
+        const char *block;
+        size_t length;
+        while (decompressor.next(block, length))
+            plain.append(block, length);
+        if (decompressor.error()) {
+            error = decompressor.error();
+            return false;
+        }
+    }
+    data.swap(plain);
+    return true;
+}
+
+// Reads the reply to a request, err is the exit code for an ERR reply
+static int readReply(Connection &connection, std::string *data, int err)
+{
+    std::string line;
+    if (!connection.readLine(line)) {
+        fprintf(stderr, "Lost connection to server\n");
+        return 2;
+    }
+    if (line.compare(0, 4, "ERR ") == 0) {
+        fprintf(stderr, "%s\n", line.c_str() + 4);
+        return err;
+    }
+    unsigned long long length;
+    if (!data) {
+        if (line == "OK")
+            return 0;
+    } else if (line.compare(0, 3, "OK ") == 0 && parseCount(line.substr(3), &length)) {
+        if (connection.read(length, *data))
+            return 0;
+    }
+    fprintf(stderr, "Invalid reply from server\n");
+    return 2;
+}
+
+int runClient(const char *path, const std::string &name, const PatternSet &set,
+              char **inputs, size_t count)
+{
+    struct sockaddr_un addr;
+    if (!socketAddress(path, &addr))
+        return 1;
+    signal(SIGPIPE, SIG_IGN);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr))) {
+        fprintf(stderr, "Can't connect to %s: %s\n", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return 2;
+    }
+    Connection connection(fd);
+    char buf[128];
+    int ret;
+    if (!set.patterns.empty()) {
+        snprintf(buf, sizeof(buf), " %u %zu\n", set.flags, set.patterns.size());
+        std::string request = "DEFINE " + name + buf;
+        for (std::vector<std::string>::const_iterator it = set.patterns.begin(); it != set.patterns.end(); ++it) {
+            if (it->find('\n') != std::string::npos) {
+                fprintf(stderr, "Patterns can't contain newlines in client mode\n");
+                return 1;
+            }
+            request += *it;
+            request += '\n';
+        }
+        if (!connection.write(request)) {
+            fprintf(stderr, "Lost connection to server\n");
+            return 2;
+        }
+        if ((ret = readReply(connection, 0, 3)))
+            return ret;
+    }
+    for (size_t i=0; i<std::max<size_t>(count, 1); ++i) {
+        std::string data;
+        const int input = count ? open(inputs[i], O_RDONLY) : STDIN_FILENO;
+        const bool ok = input != -1 && readAll(input, data);
+        if (input > STDIN_FILENO)
+            close(input);
+        if (!ok) {
+            fprintf(stderr, "Can't open %s for reading\n", count ? inputs[i] : "stdin");
+            return 2;
+        }
+        std::string error;
+        if (!decompress(data, error)) {
+            fprintf(stderr, "Can't read %s: %s\n", count ? inputs[i] : "stdin", error.c_str());
+            return 2;
+        }
+        snprintf(buf, sizeof(buf), " %zu\n", data.size());
+        if (!connection.write("FILTER " + name + buf) || !connection.write(data)) {
+            fprintf(stderr, "Lost connection to server\n");
+            return 2;
+        }
+        if ((ret = readReply(connection, &data, 1)))
+            return ret;
+        size_t written = 0;
+        while (written < data.size()) {
+            const ssize_t w = write(STDOUT_FILENO, data.c_str() + written, data.size() - written);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                return 1;
+            written += w;
+        }
+    }
+    return 0;
+}
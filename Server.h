@@ -0,0 +1,48 @@
+#ifndef Server_h
+#define Server_h
+
+#include <string>
+#include <vector>
+
+// A filter daemon on a Unix socket that keeps named, compiled pattern sets
+// around so clients don't pay for compiling them on every run. The
+// protocol is line based:
+//
+//   DEFINE <name> <flags> <count>\n  followed by count lines of "+pattern"
+//                                    (--in) or "-pattern" (--out)
+//   FILTER <name> <length>\n         followed by length bytes of diff
+//
+// DEFINE answers "OK\n", FILTER answers "OK <length>\n" followed by the
+// kept hunks. Errors are answered with "ERR <message>\n". Redefining a set
+// with the same flags and patterns keeps the compiled one.
+//
+// Only the 256 most recently used sets are kept, "default" aside, so a set
+// may have to be defined again. Sets of more than 4096 patterns or 1m of
+// them, lines over 64k and diffs over 256m are refused and the connection
+// is closed. At most 8 clients are served at once, later ones wait for a
+// connection to close.
+
+struct PatternSet
+{
+    PatternSet()
+        : flags(0)
+    {}
+
+    unsigned int flags;
+    // Prefixed with '+' for --in and '-' for --out patterns
+    std::vector<std::string> patterns;
+
+    // A name derived from the flags and patterns, for clients that don't
+    // name their set
+    std::string hashName() const;
+};
+
+// Returns the exit code
+int runServer(const char *path, const PatternSet &defaults);
+// set is defined on the server first unless it has no patterns. inputs are
+// file names, stdin is filtered when there are none. Compressed inputs are
+// decompressed before they're sent.
+int runClient(const char *path, const std::string &name, const PatternSet &set,
+              char **inputs, size_t count);
+
+#endif
@@ -0,0 +1,79 @@
+#include "Stats.h"
+#include <time.h>
+
+Stats::Stats(size_t patterns)
+    : mPatterns(patterns), mCounters(new Counter[patterns + 1]), mLines(0), mCached(0), mRead(0), mWritten(0),
+      mLineLookups(0), mLineHits(0)
+{
+    for (size_t i=0; i<PhaseCount; ++i)
+        mTimes[i] = 0;
+}
+
+Stats::~Stats()
+{
+    delete[] mCounters;
+}
+
+unsigned long long Stats::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void printJsonString(FILE *f, const std::string &str)
+{
+    fputc('"', f);
+    for (std::string::const_iterator it = str.begin(); it != str.end(); ++it) {
+        const unsigned char ch = *it;
+        if (ch == '"' || ch == '\\') {
+            fprintf(f, "\\%c", ch);
+        } else if (ch < 0x20) {
+            fprintf(f, "\\u%04x", ch);
+        } else {
+            fputc(ch, f);
+        }
+    }
+    fputc('"', f);
+}
+
+void Stats::print(FILE *f, const std::vector<std::string> &names, bool json) const
+{
+    unsigned long long kept = 0, dropped = 0;
+    for (size_t i=0; i<=mPatterns; ++i) {
+        kept += mCounters[i].kept;
+        dropped += mCounters[i].dropped;
+    }
+    const double read = mTimes[Read] / 1e9, match = mTimes[Match] / 1e9, write = mTimes[Write] / 1e9;
+    if (json) {
+        fprintf(f, "{\"hunks\":%llu,\"kept\":%llu,\"dropped\":%llu,\"cached\":%llu,\"lines\":%llu,"
+                "\"bytesRead\":%llu,\"bytesWritten\":%llu,\"lineCache\":{\"lookups\":%llu,\"hits\":%llu},"
+                "\"time\":{\"read\":%.6f,\"match\":%.6f,\"write\":%.6f},\"patterns\":[",
+                kept + dropped, kept, dropped, mCached.load(), mLines.load(), mRead.load(), mWritten.load(),
+                mLineLookups, mLineHits, read, match, write);
+        for (size_t i=0; i<mPatterns; ++i) {
+            fprintf(f, "%s{\"pattern\":", i ? "," : "");
+            printJsonString(f, i < names.size() ? names[i] : std::string());
+            fprintf(f, ",\"kept\":%llu,\"dropped\":%llu}", mCounters[i].kept.load(), mCounters[i].dropped.load());
+        }
+        fprintf(f, "],\"unmatched\":{\"kept\":%llu,\"dropped\":%llu}}\n",
+                mCounters[mPatterns].kept.load(), mCounters[mPatterns].dropped.load());
+        return;
+    }
+    fprintf(f, "hunks: %llu (kept %llu, dropped %llu)\n", kept + dropped, kept, dropped);
+    if (mCached)
+        fprintf(f, "hunks from decision cache: %llu\n", mCached.load());
+    fprintf(f, "lines evaluated: %llu\n", mLines.load());
+    if (mLineLookups) {
+        fprintf(f, "line cache: %llu of %llu lookups hit (%.1f%%)\n", mLineHits, mLineLookups,
+                100.0 * mLineHits / mLineLookups);
+    }
+    fprintf(f, "bytes read: %llu, written: %llu\n", mRead.load(), mWritten.load());
+    fprintf(f, "time: read %.3fs, match %.3fs, write %.3fs\n", read, match, write);
+    fprintf(f, "%12s %12s  pattern\n", "kept", "dropped");
+    for (size_t i=0; i<mPatterns; ++i) {
+        fprintf(f, "%12llu %12llu  %s\n", mCounters[i].kept.load(), mCounters[i].dropped.load(),
+                i < names.size() ? names[i].c_str() : "");
+    }
+    fprintf(f, "%12llu %12llu  (no match)\n", mCounters[mPatterns].kept.load(), mCounters[mPatterns].dropped.load());
+}
@@ -0,0 +1,77 @@
+#ifndef Stats_h
+#define Stats_h
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdio.h>
+
+// Counters and phase timings for --stats. Everything is updated with
+// relaxed atomics at most once per hunk, line batch or write, so the
+// instrumentation can be left on for real inputs. Times are summed across
+// threads and may add up to more than the wall time.
+class Stats
+{
+public:
+    enum Phase {
+        Read,
+        Match,
+        Write,
+        PhaseCount
+    };
+
+    Stats(size_t patterns);
+    ~Stats();
+
+    // match is the index of the first pattern that matched the hunk, or the
+    // pattern count if none did.
+    void hunk(size_t match, bool keep, size_t lines)
+    {
+        Counter &counter = mCounters[match < mPatterns ? match : mPatterns];
+        (keep ? counter.kept : counter.dropped).fetch_add(1, std::memory_order_relaxed);
+        mLines.fetch_add(lines, std::memory_order_relaxed);
+    }
+
+    // A hunk whose outcome came from the decision cache, on top of hunk()
+    void cached() { mCached.fetch_add(1, std::memory_order_relaxed); }
+
+    // Set once at the end, from the line cache
+    void lineCache(unsigned long long lookups, unsigned long long hits)
+    {
+        mLineLookups = lookups;
+        mLineHits = hits;
+    }
+
+    void read(size_t bytes) { mRead.fetch_add(bytes, std::memory_order_relaxed); }
+    void written(size_t bytes) { mWritten.fetch_add(bytes, std::memory_order_relaxed); }
+
+    // Nanoseconds on a monotonic clock
+    static unsigned long long now();
+    void time(Phase phase, unsigned long long start) { add(phase, now() - start); }
+    void add(Phase phase, unsigned long long elapsed) { mTimes[phase].fetch_add(elapsed, std::memory_order_relaxed); }
+
+    // names holds a description of each pattern, in priority order
+    void print(FILE *f, const std::vector<std::string> &names, bool json) const;
+
+private:
+    Stats(const Stats &);
+    Stats &operator=(const Stats &);
+
+    struct Counter
+    {
+        Counter()
+            : kept(0), dropped(0)
+        {}
+
+        std::atomic<unsigned long long> kept, dropped;
+    };
+
+    const size_t mPatterns;
+    Counter *mCounters;
+    std::atomic<unsigned long long> mLines, mCached, mRead, mWritten;
+    std::atomic<unsigned long long> mTimes[PhaseCount];
+    unsigned long long mLineLookups, mLineHits;
+};
+
+#endif
@@ -0,0 +1,1229 @@
+#include "Compression.h"
+#include "Hunk.h"
+#include "LineScanner.h"
+#include <getopt.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static void usage(FILE *f)
+{
+    fprintf(f,
+            "hunk_bench [options...]\n"
+            "  --help|-h                Display this help\n"
+            "  --format|-f [format]     Generate unified, normal or all diffs (default all)\n"
+            "  --size|-s [n]            Generate about n bytes of diff, k/m/g suffixes allowed (default 32m)\n"
+            "  --hunks|-n [count]       Spread the diff over count hunks (default 10000)\n"
+            "  --line-length|-l [n]     Make lines n bytes long (default 64)\n"
+            "  --patterns|-p [count]    Filter with count patterns (default 4)\n"
+            "  --iterations|-I [count]  Report the best of count runs (default 3)\n"
+            "  --jobs|-j [count]        Decide on hunks using count threads\n"
+            "  --match-context|-c       Apply matches to context lines\n"
+            "  --seed|-S [n]            Seed the generator with n\n"
+            "  --fuzz|-z [count]        Check count random diffs against a plain reimplementation and every\n"
+            "                           way of filtering them against each other instead\n"
+            "  --worst-case|-w          Time the pinned worst case inputs instead\n"
+            "  --baseline|-B [file]     Fail if a worst case is slower than in file, implies --worst-case\n"
+            "  --record|-R [file]       Write the slowest of a few worst case timings to file, implies\n"
+            "                           --worst-case\n"
+            "  --tolerance|-T [pct]     How much slower than the baseline is still fine (default 20)\n"
+            "  --kernel|-K [name]       Scan lines with the scalar, sse2, avx2, avx512 or neon kernel instead\n"
+            "                           of the best one this CPU has, or fuzz only that one instead of all\n");
+}
+
+enum Format {
+    Unified = 0x1,
+    Normal = 0x2
+};
+
+// xorshift64, so a given seed produces the same corpus everywhere
+class Random
+{
+public:
+    Random(unsigned long long seed)
+        : mState(seed ? seed : 0x9e3779b97f4a7c15ULL)
+    {}
+
+    unsigned long long next()
+    {
+        mState ^= mState << 13;
+        mState ^= mState >> 7;
+        mState ^= mState << 17;
+        return mState;
+    }
+
+    size_t below(size_t max) { return next() % max; }
+
+private:
+    unsigned long long mState;
+};
+
+struct CorpusOptions
+{
+    size_t size, hunks, lineLength, patterns;
+    unsigned long long seed;
+};
+
+// The token pattern idx matches. One hunk in two gets one of them on one of
+// its changed lines so both kept and dropped hunks are exercised.
+static std::string token(size_t idx)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "tok%zux", idx);
+    return buf;
+}
+
+static void appendLine(std::string &out, char prefix, size_t length, Random &random, const std::string &inject)
+{
+    static const char *const words[] = {
+        "int", "return", "const", "static", "value", "size_t", "if", "else", "for", "while",
+        "struct", "data", "length", "buffer", "result", "void", "char", "unsigned", "case", "break"
+    };
+    const size_t start = out.size();
+    out += prefix;
+    if (!inject.empty()) {
+        out += inject;
+        out += ' ';
+    }
+    while (out.size() - start < length) {
+        out += words[random.below(sizeof(words) / sizeof(words[0]))];
+        out += ' ';
+    }
+    out.resize(start + std::max<size_t>(length, 1));
+    out += '\n';
+}
+
+static std::string generate(Format format, const CorpusOptions &options)
+{
+    Random random(options.seed);
+    std::string out;
+    out.reserve(options.size + options.size / 8);
+    const size_t perHunk = std::max<size_t>(options.size / std::max<size_t>(options.hunks, 1), 1);
+    const size_t lines = std::max<size_t>(perHunk / (options.lineLength + 1), 2);
+    char buf[256];
+    for (size_t hunk=0; hunk<options.hunks; ++hunk) {
+        const size_t pick = options.patterns ? random.below(options.patterns * 2) : 0;
+        const std::string inject = pick < options.patterns ? token(pick) : std::string();
+        const size_t injectAt = random.below(lines);
+        if (format == Unified) {
+            snprintf(buf, sizeof(buf), "--- a/src/file%zu.cpp\n+++ b/src/file%zu.cpp\n@@ -1,%zu +1,%zu @@\n",
+                     hunk, hunk, lines, lines);
+            out += buf;
+            for (size_t i=0; i<lines; ++i) {
+                const size_t r = random.below(10);
+                char prefix = r < 7 ? ' ' : (r < 8 ? '-' : '+');
+                if (i == injectAt && !inject.empty())
+                    prefix = '+';
+                appendLine(out, prefix, options.lineLength, random, i == injectAt ? inject : std::string());
+            }
+        } else {
+            const size_t half = std::max<size_t>(lines / 2, 1);
+            snprintf(buf, sizeof(buf), "%zu,%zuc%zu,%zu\n", hunk * lines + 1, hunk * lines + half,
+                     hunk * lines + 1, hunk * lines + half);
+            out += buf;
+            for (size_t i=0; i<half; ++i)
+                appendLine(out, '<', options.lineLength, random, i == injectAt ? inject : std::string());
+            out += "---\n";
+            for (size_t i=half; i<lines; ++i)
+                appendLine(out, '>', options.lineLength, random, i == injectAt ? inject : std::string());
+        }
+    }
+    return out;
+}
+
+// Swallows the output so only the filtering is timed
+class NullOutput : public Output
+{
+public:
+    NullOutput()
+        : bytes(0)
+    {}
+
+    virtual void write(const char *, size_t length, bool)
+    {
+        bytes += length;
+    }
+
+    size_t bytes;
+};
+
+// Keeps every hunk the splitter produces so the decisions can be timed on
+// their own.
+class HunkCollector : public HunkHandler
+{
+public:
+    virtual void hunk(HunkArena &lines)
+    {
+        hunks.push_back(HunkArena(0));
+        hunks.back().swap(lines);
+    }
+
+    virtual Output &output()
+    {
+        return mOutput;
+    }
+
+    std::vector<HunkArena> hunks;
+
+private:
+    NullOutput mOutput;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void report(const char *format, const char *mode, const char *what, double best,
+                   size_t bytes, size_t hunks, size_t kept)
+{
+    printf("%-8s %-6s %-12s %9.1f MB/s %12.0f hunks/s  kept %zu/%zu\n", format, mode, what,
+           bytes / best / (1024 * 1024), hunks / best, kept, hunks);
+}
+
+static void bench(Format format, bool raw, const CorpusOptions &corpus, unsigned int flags,
+                  size_t jobs, size_t iterations)
+{
+    const std::string data = generate(format, corpus);
+    const char *formatName = format == Unified ? "unified" : "normal";
+    const char *mode = raw ? "raw" : "regex";
+
+    std::vector<std::string> patterns;
+    std::vector<Match*> matches;
+    for (size_t i=0; i<corpus.patterns; ++i) {
+        // Regexps get a bracket expression so they really go through the
+        // regexp engine rather than matching like a literal would.
+        std::string pattern = token(i);
+        if (!raw)
+            pattern.replace(pattern.size() - 1, 1, "[x-z]");
+        patterns.push_back(pattern);
+    }
+    for (size_t i=0; i<patterns.size(); ++i) {
+        const Match::Type type = i % 2 ? Match::Out : Match::In;
+        char *pattern = &patterns[i][0];
+        matches.push_back(raw
+                          ? static_cast<Match*>(new RawMatch(type, pattern)) :
+                          static_cast<Match*>(new RegexpMatch(type, pattern)));
+    }
+    const MatchSet matchSet(matches, flags | (raw ? Raw : 0));
+    const FilterOptions options(matchSet, flags | (raw ? Raw : 0));
+
+    HunkCollector collector;
+    processFile(data.c_str(), data.size(), collector, options);
+    const std::vector<HunkArena> &hunks = collector.hunks;
+
+    double best = 0;
+    size_t kept = 0;
+    for (size_t i=0; i<iterations; ++i) {
+        const Clock::time_point start = Clock::now();
+        size_t count = 0;
+        for (std::vector<HunkArena>::const_iterator it = hunks.begin(); it != hunks.end(); ++it) {
+            if (keepHunk(*it, options))
+                ++count;
+        }
+        const double elapsed = seconds(start);
+        if (!i || elapsed < best)
+            best = elapsed;
+        kept = count;
+    }
+    const double hunkBest = best;
+
+    for (size_t i=0; i<iterations; ++i) {
+        NullOutput output;
+        const Clock::time_point start = Clock::now();
+        {
+            std::unique_ptr<HunkHandler> handler;
+            if (jobs > 1) {
+                handler.reset(new ParallelFilter(options, jobs, output));
+            } else {
+                handler.reset(new SerialFilter(options, output));
+            }
+            processFile(data.c_str(), data.size(), *handler, options);
+        }
+        const double elapsed = seconds(start);
+        if (!i || elapsed < best)
+            best = elapsed;
+    }
+    report(formatName, mode, "processFile", best, data.size(), hunks.size(), kept);
+    report(formatName, mode, "processHunk", hunkBest, data.size(), hunks.size(), kept);
+
+    for (std::vector<Match*>::const_iterator it = matches.begin(); it != matches.end(); ++it) {
+        delete *it;
+    }
+}
+
+// Hands out data in pieces of random size so lines straddle blocks the way
+// they do when read from a pipe
+class ChunkSource : public BlockSource
+{
+public:
+    ChunkSource(const std::string &data, Random &random, size_t maxChunk)
+        : mData(data), mRandom(random), mMaxChunk(maxChunk), mPos(0)
+    {}
+
+    virtual bool next(const char *&data, size_t &length)
+    {
+        if (mPos == mData.size())
+            return false;
+        length = std::min(mData.size() - mPos, 1 + mRandom.below(mMaxChunk));
+        data = mData.c_str() + mPos;
+        mPos += length;
+        return true;
+    }
+
+private:
+    const std::string &mData;
+    Random &mRandom;
+    const size_t mMaxChunk;
+    size_t mPos;
+};
+
+// What the reference decided about a hunk, or with --files a file section
+struct Decision
+{
+    size_t offset, length, match;
+    bool keep;
+};
+
+// What --where conditions look at, gathered the slow way from the lines
+// that are evaluated: all of a hunk's, or those of a file section before
+// its hunks
+struct Facts
+{
+    Facts()
+        : added(0), removed(0), bytes(0), rank(0)
+    {}
+
+    void line(const char *data, size_t length, LineKind kind)
+    {
+        bytes += length;
+        if (kind == ChangeLine) {
+            const bool add = data[0] == '+' || data[0] == '>';
+            ++(add ? added : removed);
+            for (size_t i=1; i<length; ++i) {
+                if (!isspace(static_cast<unsigned char>(data[i])))
+                    (add ? newText : oldText) += data[i];
+            }
+            return;
+        }
+        // The "+++ " line names the path, failing that the "--- " line and
+        // failing that the "diff --git" one
+        int lineRank = 0;
+        size_t skip = 4;
+        if (kind == HeaderLine && data[0] == '+') {
+            lineRank = 3;
+        } else if (kind == HunkStartLine && data[0] == '-') {
+            lineRank = 2;
+        } else if (kind == OtherLine && length > 11 && !memcmp(data, "diff --git ", 11)) {
+            const char *b = static_cast<const char *>(memmem(data, length, " b/", 3));
+            if (b) {
+                lineRank = 1;
+                skip = b + 1 - data;
+            }
+        }
+        if (!lineRank || lineRank < rank)
+            return;
+        std::string name(data + skip, length - skip);
+        name.erase(std::min(name.size(), name.find_first_of("\t\r\n")));
+        if (name == "/dev/null")
+            return;
+        if (name.size() > 2 && (name[0] == 'a' || name[0] == 'b') && name[1] == '/')
+            name.erase(0, 2);
+        rank = lineRank;
+        path = name;
+    }
+
+    bool whitespaceOnly() const { return (added || removed) && oldText == newText; }
+
+    size_t added, removed, bytes;
+    // The removed and the added lines without their whitespace
+    std::string oldText, newText;
+    std::string path;
+    int rank;
+};
+
+// The --where conditions the fuzzer picks from, met() says what they mean.
+// The last ones are about the path, the only ones that work with --files.
+static const char *const conditions[] = {
+    "added>2", "removed<=1", "changed!=3", "size<300", "whitespace", "!whitespace", "path~a", "path!~x"
+};
+enum {
+    ConditionCount = sizeof(conditions) / sizeof(conditions[0]),
+    PathConditions = 2
+};
+
+static bool met(size_t condition, const Facts &facts)
+{
+    switch (condition) {
+    case 0:
+        return facts.added > 2;
+    case 1:
+        return facts.removed <= 1;
+    case 2:
+        return facts.added + facts.removed != 3;
+    case 3:
+        return facts.bytes < 300;
+    case 4:
+        return facts.whitespaceOnly();
+    case 5:
+        return !facts.whitespaceOnly();
+    case 6:
+        return facts.path.find('a') != std::string::npos;
+    default:
+        return facts.path.find('x') == std::string::npos;
+    }
+}
+
+static size_t firstMatch(const std::vector<Match*> &matches, const char *line, size_t length, size_t limit)
+{
+    for (size_t m=0; m<limit; ++m) {
+        if (matches[m]->match(line, length))
+            return m;
+    }
+    return limit;
+}
+
+static void decide(std::vector<Decision> &decisions, size_t offset, size_t length, size_t best, bool matchable,
+                   const Facts &facts, const std::vector<Match*> &matches, const std::vector<size_t> &where)
+{
+    if (!length)
+        return;
+    bool hasIns = false;
+    for (std::vector<Match*>::const_iterator it = matches.begin(); it != matches.end(); ++it) {
+        if ((*it)->type == Match::In)
+            hasIns = true;
+    }
+    bool keep = !(matchable && hasIns && best == matches.size())
+        && !(best < matches.size() && matches[best]->type == Match::Out);
+    for (std::vector<size_t>::const_iterator it = where.begin(); keep && it != where.end(); ++it)
+        keep = met(*it, facts);
+    const Decision decision = { offset, length, best, keep };
+    decisions.push_back(decision);
+}
+
+// What every path should come up with, worked out the slow way: lines are
+// split with memchr and matched against each pattern on its own. where has
+// the indexes of the --where conditions.
+static std::vector<Decision> reference(const std::string &data, const std::vector<Match*> &matches, unsigned int flags,
+                                       const std::vector<size_t> &where)
+{
+    std::vector<Decision> decisions;
+    Facts facts;
+    bool seenHunkStart = false, matchable = false;
+    size_t best = matches.size();
+    size_t start = 0, pos = 0;
+    while (true) {
+        const bool last = pos == data.size();
+        size_t length = 0;
+        LineKind kind = OtherLine;
+        if (!last) {
+            const char *nl = static_cast<const char *>(memchr(data.c_str() + pos, '\n', data.size() - pos));
+            length = nl ? nl - data.c_str() - pos + 1 : data.size() - pos;
+            kind = classifyLine(data.c_str() + pos, length);
+        }
+        if (last || (kind == HunkStartLine && seenHunkStart) || (kind == OtherLine && seenHunkStart)) {
+            decide(decisions, start, pos - start, best, matchable, facts, matches, where);
+            start = pos;
+            facts = Facts();
+            matchable = false;
+            best = matches.size();
+            seenHunkStart = false;
+        }
+        if (last)
+            break;
+        if (kind == HunkStartLine)
+            seenHunkStart = true;
+        const char *line = data.c_str() + pos;
+        pos += length;
+        facts.line(line, length, kind);
+        const bool lineMatchable = kind == ChangeLine || (kind == ContextLine && (flags & MatchContext))
+            || ((kind == HunkStartLine || kind == HeaderLine || kind == OtherLine) && (flags & MatchHeaders));
+        if (!lineMatchable)
+            continue;
+        matchable = true;
+        best = firstMatch(matches, line, length, best);
+    }
+    return decisions;
+}
+
+// The same for --files: a section is the lines naming its paths, then
+// its hunks, and is kept or dropped as a whole on the path lines alone.
+// A "diff " line, a second "--- " line, or any other line but a
+// "\ No newline" marker once the hunks have started, begins the next one.
+static std::vector<Decision> referenceFiles(const std::string &data, const std::vector<Match*> &matches,
+                                            const std::vector<size_t> &where)
+{
+    std::vector<Decision> decisions;
+    Facts facts;
+    bool inHunks = false, seenOld = false, matchable = false;
+    size_t best = matches.size();
+    size_t start = 0, pos = 0;
+    while (true) {
+        const bool last = pos == data.size();
+        size_t length = 0;
+        const char *line = data.c_str() + pos;
+        LineKind kind = OtherLine;
+        bool ends = last, pathLine = false, old = false;
+        if (!last) {
+            const char *nl = static_cast<const char *>(memchr(line, '\n', data.size() - pos));
+            length = nl ? nl - line + 1 : data.size() - pos;
+            const bool diff = length >= 5 && !memcmp(line, "diff ", 5);
+            const bool marker = line[0] == '\\';
+            old = length >= 4 && !memcmp(line, "--- ", 4);
+            kind = classifyLine(line, length);
+            if (diff) {
+                ends = pathLine = true;
+            } else if (old) {
+                ends = inHunks || seenOld;
+                pathLine = true;
+            } else if (kind == OtherLine) {
+                ends = inHunks && !marker;
+            } else if (length >= 4 && !memcmp(line, "+++ ", 4)) {
+                pathLine = !inHunks;
+            }
+            if (!ends && !pathLine && kind != OtherLine)
+                inHunks = true;
+            if (old && !ends)
+                seenOld = true;
+        }
+        if (ends) {
+            decide(decisions, start, pos - start, best, matchable, facts, matches, where);
+            start = pos;
+            facts = Facts();
+            inHunks = seenOld = matchable = false;
+            best = matches.size();
+            if (last)
+                break;
+            seenOld = old;
+        }
+        pos += length;
+        if (!inHunks)
+            facts.line(line, length, kind);
+        if (!pathLine)
+            continue;
+        matchable = true;
+        best = firstMatch(matches, line, length, best);
+    }
+    return decisions;
+}
+
+// What a run writes, compared as a whole: the kept hunks, one string per
+// --group output starting with stdout's, or with --index the records
+typedef std::vector<std::string> Outcome;
+
+// Group 0 is stdout
+static size_t outputCount(const std::vector<size_t> &groups)
+{
+    return groups.empty() ? 1 : *std::max_element(groups.begin(), groups.end()) + 1;
+}
+
+// Appends what a run should write for decisions about data, as file number
+// file
+static void expect(Outcome &outcome, const std::string &data, const std::vector<Decision> &decisions,
+                   unsigned int flags, const std::vector<size_t> &groups, size_t patterns, size_t file)
+{
+    outcome.resize(outputCount(groups));
+    for (std::vector<Decision>::const_iterator it = decisions.begin(); it != decisions.end(); ++it) {
+        if (flags & Index) {
+            IndexRecord record;
+            record.offset = it->offset;
+            record.length = it->length;
+            record.file = file;
+            record.match = it->match < patterns ? static_cast<uint32_t>(it->match)
+                : static_cast<uint32_t>(IndexRecord::NoMatch);
+            if (it->keep)
+                record.match |= IndexRecord::Kept;
+            outcome[0].append(reinterpret_cast<const char *>(&record), sizeof(record));
+        } else if (it->keep) {
+            outcome[it->match < patterns && !groups.empty() ? groups[it->match] : 0].append(data, it->offset, it->length);
+        }
+    }
+}
+
+// Diffs made of the line starts the splitter cares about, and a few it
+// should treat as anything else, with now and then a line of over 16k
+static std::string fuzzInput(Random &random)
+{
+    static const char *const starts[] = {
+        "+", "-", " ", "<", ">", "--- a/", "+++ b/", "@@ -1,2 +1,2 @@", "@@", "---", "+++", "--", "++",
+        "1c1", "12,3d4", "5a6,7", "diff --git a/x b/x", "index 12..34", "\\ No newline at end of file", ""
+    };
+    // Ends in a NUL on purpose, regexec and RE2 have to agree on those too
+    static const char chars[] = "abcx09 \t+-\0";
+    std::string out;
+    const size_t lines = random.below(60);
+    for (size_t i=0; i<lines; ++i) {
+        out += starts[random.below(sizeof(starts) / sizeof(starts[0]))];
+        const size_t length = random.below(50) ? random.below(40) : 16 * 1024 + random.below(24 * 1024);
+        for (size_t j=0; j<length; ++j)
+            out += chars[random.below(sizeof(chars) - 1)];
+        if (random.below(20)) {
+            out += '\n';
+        } else if (i + 1 < lines) {
+            out += "\r\n";
+        }
+    }
+    return out;
+}
+
+// Puts together what a run writes the way main() does, to compare with
+// expect()
+class FuzzOutput
+{
+public:
+    FuzzOutput(const FilterOptions &options, const std::vector<size_t> &groups)
+        : mBuffers(outputCount(groups)), mIndex(mBuffers[0], false, options.matches.size()), mOutput(&mBuffers[0])
+    {
+        std::vector<Output*> routes;
+        for (std::vector<size_t>::const_iterator it = groups.begin(); it != groups.end(); ++it)
+            routes.push_back(&mBuffers[*it]);
+        mSplit.reset(new SplitOutput(mBuffers[0], routes));
+        if (options.flags & Index) {
+            mOutput = &mIndex;
+        } else if (!groups.empty()) {
+            mOutput = mSplit.get();
+        }
+    }
+
+    Output &output() { return *mOutput; }
+
+    Outcome outcome()
+    {
+        Outcome ret;
+        for (std::vector<BufferOutput>::iterator it = mBuffers.begin(); it != mBuffers.end(); ++it)
+            ret.push_back(it->buffer());
+        return ret;
+    }
+
+private:
+    std::vector<BufferOutput> mBuffers;
+    IndexOutput mIndex;
+    std::unique_ptr<SplitOutput> mSplit;
+    Output *mOutput;
+};
+
+// Holds data in a file for the paths that read one, compressed if asked
+// to, and removes it again
+class TempFile
+{
+public:
+    TempFile(const std::string &data, Compression compression = Uncompressed)
+        : mOk(false)
+    {
+        char path[] = P_tmpdir "/hunk-fuzz-XXXXXX";
+        const int fd = mkstemp(path);
+        if (fd == -1)
+            return;
+        mPath = path;
+        {
+            FdOutput output(fd, 65536);
+            if (compression == Uncompressed) {
+                output.write(data.c_str(), data.size(), false);
+            } else {
+                CompressedOutput compressed(compression, output);
+                compressed.write(data.c_str(), data.size(), false);
+                compressed.finish();
+            }
+            output.flush();
+            mOk = !output.error();
+        }
+        mOk = !close(fd) && mOk;
+    }
+
+    ~TempFile()
+    {
+        if (!mPath.empty())
+            unlink(mPath.c_str());
+    }
+
+    // 0 if the file couldn't be written
+    const char *path() const { return mOk ? mPath.c_str() : 0; }
+
+private:
+    TempFile(const TempFile &);
+    TempFile &operator=(const TempFile &);
+
+    std::string mPath;
+    bool mOk;
+};
+
+// The files a case is read from besides memory. compressed is 0 if the
+// build can't write either compression.
+struct FuzzFiles
+{
+    const char *plain, *compressed, *cache;
+};
+
+static Outcome filterMapped(const std::string &data, const FilterOptions &options, const std::vector<size_t> &groups,
+                            size_t jobs)
+{
+    FuzzOutput output(options, groups);
+    {
+        std::unique_ptr<HunkHandler> handler;
+        if (jobs > 1) {
+            handler.reset(new ParallelFilter(options, jobs, output.output()));
+        } else {
+            handler.reset(new SerialFilter(options, output.output()));
+        }
+        processFile(data.c_str(), data.size(), *handler, options);
+    }
+    return output.outcome();
+}
+
+static Outcome filterChunks(const std::string &data, const FilterOptions &options, const std::vector<size_t> &groups,
+                            Random &random)
+{
+    FuzzOutput output(options, groups);
+    SerialFilter filter(options, output.output());
+    ChunkSource source(data, random, 1 + random.below(4096));
+    processBlocks(source, filter, options);
+    filter.sync();
+    return output.outcome();
+}
+
+// Through processPath(), which maps the file, or processFile() reading it
+// as a stream. Nothing comes out if it fails.
+static Outcome filterFile(const char *path, bool stream, const FilterOptions &options,
+                          const std::vector<size_t> &groups)
+{
+    FuzzOutput output(options, groups);
+    SerialFilter filter(options, output.output());
+    bool ok;
+    if (stream) {
+        const int fd = open(path, O_RDONLY);
+        ok = fd != -1 && processFile(fd, filter, options);
+        if (fd != -1)
+            close(fd);
+    } else {
+        ok = processPath(path, filter, options);
+    }
+    filter.sync();
+    return ok ? output.outcome() : Outcome();
+}
+
+static Outcome filterPaths(char **paths, size_t count, const FilterOptions &options)
+{
+    BufferOutput output;
+    if (!processPaths(paths, count, options, 2, output))
+        return Outcome();
+    return Outcome(1, output.buffer());
+}
+
+// The name of the first way of filtering data that doesn't come up with
+// expected, or 0 if they all do. twice is what filtering files.plain and
+// files.compressed together comes up with. The ways that read files only
+// go with files, their threads and blocks take a while to set up.
+static const char *disagreement(const std::string &data, const Outcome &expected, const Outcome &twice,
+                                const FilterOptions &options, const std::vector<size_t> &groups,
+                                const FuzzFiles *files, Random &random)
+{
+    FilterOptions spilling(options);
+    spilling.hunkMemory = 1 + random.below(512);
+    LineCache cache(1024);
+    FilterOptions cached(options);
+    cached.lines = &cache;
+    if (filterMapped(data, options, groups, 1) != expected)
+        return "mapped";
+    if (filterMapped(data, options, groups, 3) != expected)
+        return "parallel";
+    if (filterChunks(data, options, groups, random) != expected)
+        return "stream";
+    if (filterMapped(data, spilling, groups, 1) != expected)
+        return "mapped spill";
+    if (filterChunks(data, spilling, groups, random) != expected)
+        return "stream spill";
+    if (filterMapped(data, cached, groups, 3) != expected)
+        return "line cache";
+    if (!files)
+        return 0;
+    if (filterFile(files->plain, false, options, groups) != expected)
+        return "file";
+    if (filterFile(files->plain, true, spilling, groups) != expected)
+        return "fd";
+    if (files->compressed && filterFile(files->compressed, false, options, groups) != expected)
+        return "compressed file";
+    if (files->compressed && filterFile(files->compressed, true, spilling, groups) != expected)
+        return "compressed fd";
+    // Filled on one run and decided from on the next
+    enum { CacheKey = 1 };
+    DecisionCache filling(CacheKey), filled(CacheKey);
+    FilterOptions deciding(options);
+    deciding.decisions = &filling;
+    if (filterMapped(data, deciding, groups, 1) != expected)
+        return "decision cache";
+    if (!filling.save(files->cache) || !filled.load(files->cache))
+        return "decision cache file";
+    deciding.decisions = &filled;
+    if (filterMapped(data, deciding, groups, 3) != expected)
+        return "cached decisions";
+    // main() only filters files side by side without groups
+    if (groups.empty()) {
+        char *paths[] = {
+            const_cast<char *>(files->plain), const_cast<char *>(files->compressed ? files->compressed : files->plain)
+        };
+        if (filterPaths(paths, 2, options) != twice)
+            return "paths";
+    }
+    return 0;
+}
+
+// The line kernels this CPU has, or just the active one
+static std::vector<std::string> fuzzKernels(bool all)
+{
+    std::vector<std::string> kernels;
+    if (!all) {
+        kernels.push_back(lineKernel());
+        return kernels;
+    }
+    const std::string active = lineKernel();
+    for (size_t k=0; lineKernelName(k); ++k) {
+        if (setLineKernel(lineKernelName(k)))
+            kernels.push_back(lineKernelName(k));
+    }
+    setLineKernel(active.c_str());
+    return kernels;
+}
+
+// Filters data with patterns, --where conditions and groups picked from
+// random through every path, with every kernel in kernels, and checks that
+// they all agree with reference() or referenceFiles(). The paths that read
+// files only run now and then, with one of the kernels. Returns false with
+// what disagreed in failure.
+static bool fuzzCase(const std::string &data, unsigned int flags, Random &random,
+                     const std::vector<std::string> &kernels, std::string *failure)
+{
+    static const char *const raws[] = { "a", "ab", "x0", "b c", "+a", "9", "--", "\t", "cx" };
+    static const char *const regexps[] = {
+        "a.b", "^+a", "[0-9]x", "ab*c", "^-", "c[ab]", "x\\{2\\}", "\\(ab\\)\\1", "^[<>]", "b \\+c", "^@@"
+    };
+    std::vector<std::string> patterns;
+    std::vector<Match*> matches;
+    const size_t patternCount = 1 + random.below(5);
+    for (size_t p=0; p<patternCount; ++p) {
+        patterns.push_back(flags & Raw ? raws[random.below(sizeof(raws) / sizeof(raws[0]))]
+                           : regexps[random.below(sizeof(regexps) / sizeof(regexps[0]))]);
+    }
+    for (size_t p=0; p<patternCount; ++p) {
+        const Match::Type type = random.below(3) ? Match::In : Match::Out;
+        char *pattern = &patterns[p][0];
+        matches.push_back(flags & Raw
+                          ? static_cast<Match*>(new RawMatch(type, pattern)) :
+                          static_cast<Match*>(new RegexpMatch(type, pattern)));
+    }
+    // A third of the cases get --where conditions, and a third of those
+    // without --index have their patterns split into groups like --group
+    // does, each going to the group of the last -G before it
+    Predicates predicates;
+    std::vector<size_t> where;
+    if (!random.below(3)) {
+        const size_t count = 1 + random.below(2);
+        for (size_t i=0; i<count; ++i) {
+            where.push_back(flags & Files ? ConditionCount - PathConditions + random.below(PathConditions)
+                            : random.below(ConditionCount));
+            predicates.add(conditions[where.back()]);
+        }
+    }
+    std::vector<size_t> groups;
+    if (!(flags & Index) && !random.below(3)) {
+        for (size_t p=0; p<patternCount; ++p)
+            groups.push_back((p ? groups.back() : 0) + !random.below(3));
+    }
+    const MatchSet matchSet(matches, flags, 0, groups.empty() ? 0 : &groups);
+    FilterOptions options(matchSet, flags);
+    options.predicates = where.empty() ? 0 : &predicates;
+
+    const std::vector<Decision> decisions = flags & Files ? referenceFiles(data, matches, where)
+        : reference(data, matches, flags, where);
+    Outcome expected, twice;
+    expect(expected, data, decisions, flags, groups, patternCount, 0);
+    expect(twice, data, decisions, flags, groups, patternCount, 0);
+    expect(twice, data, decisions, flags, groups, patternCount, 1);
+    Compression compression = Uncompressed;
+    if (compressionSupported(Zstd) && (!compressionSupported(Gzip) || random.below(2))) {
+        compression = Zstd;
+    } else if (compressionSupported(Gzip)) {
+        compression = Gzip;
+    }
+    const TempFile plain(data), compressed(data, compression), cache((std::string()));
+    const FuzzFiles files = { plain.path(), compression == Uncompressed ? 0 : compressed.path(), cache.path() };
+    const char *failed = 0;
+    std::vector<std::string>::const_iterator kernel = kernels.begin();
+    if (!files.plain || !files.cache || (compression != Uncompressed && !files.compressed)) {
+        failed = "temporary file";
+        kernel = kernels.end();
+    }
+    // Reading files is slow enough to only be done in about every fourth
+    // case, with one of the kernels
+    const size_t fileKernel = random.below(4) ? kernels.size() : random.below(kernels.size());
+    for (; !failed && kernel != kernels.end(); ++kernel) {
+        setLineKernel(kernel->c_str());
+        const bool withFiles = static_cast<size_t>(kernel - kernels.begin()) == fileKernel;
+        failed = disagreement(data, expected, twice, options, groups, withFiles ? &files : 0, random);
+    }
+    if (failed) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "the %s path disagrees with the %s kernel, flags 0x%x, patterns:", failed,
+                 (kernel - 1)->c_str(), flags);
+        *failure = buf;
+        for (std::vector<Match*>::const_iterator it = matches.begin(); it != matches.end(); ++it) {
+            *failure += " " + (*it)->toString();
+            if (!groups.empty()) {
+                snprintf(buf, sizeof(buf), " (group %zu)", groups[it - matches.begin()]);
+                *failure += buf;
+            }
+        }
+        for (std::vector<size_t>::const_iterator it = where.begin(); it != where.end(); ++it)
+            *failure += std::string(" --where=") + conditions[*it];
+    }
+    for (std::vector<Match*>::const_iterator it = matches.begin(); it != matches.end(); ++it) {
+        delete *it;
+    }
+    return !failed;
+}
+
+// Runs count random inputs through fuzzCase(). A disagreement is saved as
+// hunk-fuzz-<case>.diff.
+static bool fuzz(size_t count, unsigned long long seed, bool allKernels)
+{
+    const std::vector<std::string> kernels = fuzzKernels(allKernels);
+    Random random(seed);
+    for (size_t i=0; i<count; ++i) {
+        const std::string data = fuzzInput(random);
+        unsigned int flags = (random.below(2) ? MatchContext : 0) | (random.below(2) ? MatchHeaders : 0);
+        if (!random.below(4))
+            flags |= Files;
+        if (random.below(2))
+            flags |= Raw;
+        if (!random.below(4))
+            flags |= Index;
+        std::string failure;
+        if (fuzzCase(data, flags, random, kernels, &failure))
+            continue;
+        char name[64];
+        snprintf(name, sizeof(name), "hunk-fuzz-%zu.diff", i);
+        fprintf(stderr, "Case %zu: %s", i, failure.c_str());
+        FILE *f = fopen(name, "w");
+        if (f) {
+            fwrite(data.c_str(), data.size(), 1, f);
+            fclose(f);
+            fprintf(stderr, ", input in %s", name);
+        }
+        fprintf(stderr, "\n");
+        return false;
+    }
+    std::string names;
+    for (std::vector<std::string>::const_iterator it = kernels.begin(); it != kernels.end(); ++it)
+        names += (names.empty() ? "" : ", ") + *it;
+    printf("%zu cases, every path agreed with the %s kernel%s\n", count, names.c_str(), kernels.size() > 1 ? "s" : "");
+    return true;
+}
+
+// The inputs that have been slow before, or would be if something
+// regressed. Their corpora only depend on the seed and the size.
+struct WorstCase
+{
+    const char *name;
+    Format format;
+    // The hunk count follows from the size
+    size_t hunkSize, lineLength;
+    // Matched as regexps, tokens are added to the corpus as usual
+    const char *patterns[4];
+};
+
+static const WorstCase worstCases[] = {
+    { "huge-hunks", Unified, 8 * 1024 * 1024, 64, { "tok0x", "tok1[x-z]", 0, 0 } },
+    { "tiny-hunks", Unified, 100, 16, { "tok0x", "tok1[x-z]", 0, 0 } },
+    { "long-lines", Unified, 256 * 1024, 20000, { "tok0x", "tok1[x-z]", 0, 0 } },
+    { "normal-diff", Normal, 3 * 1024, 64, { "tok0x", "tok1[x-z]", 0, 0 } },
+    // Nothing to prefilter on, every line goes through the regexps
+    { "no-literals", Unified, 3 * 1024, 64, { "[a-z]*[0-9][0-9]q", "\\(ab*\\)*c[0-9]", "^+[xyz]\\{3\\}", 0 } }
+};
+
+static double throughput(const std::string &data, const FilterOptions &options, size_t jobs, size_t iterations)
+{
+    double best = 0;
+    for (size_t i=0; i<iterations; ++i) {
+        NullOutput output;
+        const Clock::time_point start = Clock::now();
+        {
+            std::unique_ptr<HunkHandler> handler;
+            if (jobs > 1) {
+                handler.reset(new ParallelFilter(options, jobs, output));
+            } else {
+                handler.reset(new SerialFilter(options, output));
+            }
+            processFile(data.c_str(), data.size(), *handler, options);
+        }
+        const double elapsed = seconds(start);
+        if (!i || elapsed < best)
+            best = elapsed;
+    }
+    return data.size() / best / (1024 * 1024);
+}
+
+// A baseline has a "name size MB/s" line per case, the slowest of a few
+// timings. Cases that were timed with another size are skipped, ones that
+// seem slower are timed again a few times before they count as regressed.
+static bool worstCase(const CorpusOptions &corpus, unsigned int flags, size_t jobs, size_t iterations,
+                      const char *baseline, const char *record, double tolerance)
+{
+    std::vector<std::pair<std::string, std::pair<size_t, double> > > previous;
+    if (baseline) {
+        FILE *f = fopen(baseline, "r");
+        if (!f) {
+            fprintf(stderr, "Can't open %s for reading\n", baseline);
+            return false;
+        }
+        char name[64];
+        size_t size;
+        double rate;
+        while (fscanf(f, "%63s %zu %lf", name, &size, &rate) == 3)
+            previous.push_back(std::make_pair(name, std::make_pair(size, rate)));
+        fclose(f);
+    }
+    FILE *out = 0;
+    if (record && !(out = fopen(record, "w"))) {
+        fprintf(stderr, "Can't open %s for writing\n", record);
+        return false;
+    }
+    enum { Retries = 4 };
+    bool ok = true;
+    for (size_t i=0; i<sizeof(worstCases) / sizeof(worstCases[0]); ++i) {
+        const WorstCase &worst = worstCases[i];
+        CorpusOptions options = corpus;
+        options.hunks = std::max<size_t>(corpus.size / worst.hunkSize, 1);
+        options.lineLength = worst.lineLength;
+        options.patterns = 2;
+        const std::string data = generate(worst.format, options);
+        std::vector<std::string> patterns;
+        for (size_t p=0; p<sizeof(worst.patterns) / sizeof(worst.patterns[0]) && worst.patterns[p]; ++p)
+            patterns.push_back(worst.patterns[p]);
+        std::vector<Match*> matches;
+        for (size_t p=0; p<patterns.size(); ++p)
+            matches.push_back(new RegexpMatch(p % 2 ? Match::Out : Match::In, &patterns[p][0]));
+        const MatchSet matchSet(matches, flags);
+        const FilterOptions filterOptions(matchSet, flags);
+        double rate = throughput(data, filterOptions, jobs, iterations);
+        double was = 0;
+        for (size_t p=0; p<previous.size(); ++p) {
+            if (previous[p].first == worst.name && previous[p].second.first == data.size())
+                was = previous[p].second.second;
+        }
+        // Another process can take a run's worth of time, so a case only
+        // regressed if it's slow every time
+        for (size_t retry=0; retry<Retries && was && rate < was * (1 - tolerance / 100); ++retry)
+            rate = std::max(rate, throughput(data, filterOptions, jobs, iterations));
+        printf("%-12s %9.1f MB/s", worst.name, rate);
+        if (was) {
+            printf("  baseline %9.1f MB/s %+6.1f%%", was, (rate - was) / was * 100);
+            if (rate < was * (1 - tolerance / 100)) {
+                printf("  REGRESSED");
+                ok = false;
+            }
+        }
+        printf("\n");
+        if (out) {
+            // What the case manages every time, so that a later run that
+            // is only as unlucky as the worst of these doesn't fail
+            double slowest = rate;
+            for (size_t retry=0; retry<Retries; ++retry)
+                slowest = std::min(slowest, throughput(data, filterOptions, jobs, iterations));
+            fprintf(out, "%s %zu %.1f\n", worst.name, data.size(), slowest);
+        }
+        for (std::vector<Match*>::const_iterator it = matches.begin(); it != matches.end(); ++it) {
+            delete *it;
+        }
+    }
+    if (out && fclose(out)) {
+        fprintf(stderr, "Can't write %s\n", record);
+        return false;
+    }
+    return ok;
+}
+
+#if defined(HUNK_LIBFUZZER)
+// Built as hunk_fuzz when the compiler has -fsanitize=fuzzer. The first
+// byte picks the flags and the next eight seed the patterns and block
+// sizes, the rest is the diff.
+extern "C" int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+    if (size < 9)
+        return 0;
+    static const std::vector<std::string> kernels = fuzzKernels(true);
+    const unsigned int flags = (data[0] & 0x1 ? MatchContext : 0) | (data[0] & 0x2 ? MatchHeaders : 0)
+        | (data[0] & 0x4 ? Files : 0) | (data[0] & 0x8 ? Raw : 0) | (data[0] & 0x10 ? Index : 0);
+    unsigned long long seed;
+    memcpy(&seed, data + 1, sizeof(seed));
+    Random random(seed);
+    std::string failure;
+    if (!fuzzCase(std::string(reinterpret_cast<const char *>(data) + 9, size - 9), flags, random, kernels, &failure)) {
+        fprintf(stderr, "%s\n", failure.c_str());
+        abort();
+    }
+    return 0;
+}
+#else
+int main(int argc, char **argv)
+{
+    struct option opts[] = {
+        { "help", no_argument, 0, 'h' },
+        { "format", required_argument, 0, 'f' },
+        { "size", required_argument, 0, 's' },
+        { "hunks", required_argument, 0, 'n' },
+        { "line-length", required_argument, 0, 'l' },
+        { "patterns", required_argument, 0, 'p' },
+        { "iterations", required_argument, 0, 'I' },
+        { "jobs", required_argument, 0, 'j' },
+        { "match-context", no_argument, 0, 'c' },
+        { "seed", required_argument, 0, 'S' },
+        { "fuzz", required_argument, 0, 'z' },
+        { "worst-case", no_argument, 0, 'w' },
+        { "baseline", required_argument, 0, 'B' },
+        { "record", required_argument, 0, 'R' },
+        { "tolerance", required_argument, 0, 'T' },
+        { "kernel", required_argument, 0, 'K' },
+        { 0, 0, 0, 0 }
+    };
+    CorpusOptions corpus;
+    corpus.size = 32 * 1024 * 1024;
+    corpus.hunks = 10000;
+    corpus.lineLength = 64;
+    corpus.patterns = 4;
+    corpus.seed = 1;
+    unsigned int formats = Unified | Normal;
+    unsigned int flags = 0;
+    size_t iterations = 3, jobs = 1, fuzzCount = 0;
+    bool worst = false;
+    const char *baseline = 0, *record = 0, *kernel = 0;
+    double tolerance = 20;
+    while (true) {
+        const int c = getopt_long(argc, argv, "hf:s:n:l:p:I:j:cS:z:wB:R:T:K:", opts, 0);
+        if (c == -1)
+            break;
+
+        char *end;
+        switch (c) {
+        case 'h':
+            usage(stdout);
+            return 0;
+        case 'f':
+            if (!strcmp(optarg, "unified")) {
+                formats = Unified;
+            } else if (!strcmp(optarg, "normal")) {
+                formats = Normal;
+            } else if (!strcmp(optarg, "all")) {
+                formats = Unified | Normal;
+            } else {
+                fprintf(stderr, "Invalid format %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            if (!parseSize(optarg, &corpus.size) || !corpus.size) {
+                fprintf(stderr, "Invalid size %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'n':
+            corpus.hunks = strtoul(optarg, &end, 10);
+            if (*end || !corpus.hunks) {
+                fprintf(stderr, "Invalid hunk count %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            if (!parseSize(optarg, &corpus.lineLength) || !corpus.lineLength) {
+                fprintf(stderr, "Invalid line length %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p':
+            corpus.patterns = strtoul(optarg, &end, 10);
+            if (*end) {
+                fprintf(stderr, "Invalid pattern count %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'I':
+            iterations = strtoul(optarg, &end, 10);
+            if (*end || !iterations) {
+                fprintf(stderr, "Invalid iteration count %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'j':
+            jobs = strtoul(optarg, &end, 10);
+            if (*end || !jobs) {
+                fprintf(stderr, "Invalid job count %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            flags |= MatchContext;
+            break;
+        case 'S':
+            corpus.seed = strtoull(optarg, &end, 10);
+            if (*end) {
+                fprintf(stderr, "Invalid seed %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'z':
+            fuzzCount = strtoul(optarg, &end, 10);
+            if (*end || !fuzzCount) {
+                fprintf(stderr, "Invalid case count %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'w':
+            worst = true;
+            break;
+        case 'B':
+            baseline = optarg;
+            worst = true;
+            break;
+        case 'R':
+            record = optarg;
+            worst = true;
+            break;
+        case 'T':
+            tolerance = strtod(optarg, &end);
+            if (*end || tolerance < 0) {
+                fprintf(stderr, "Invalid tolerance %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'K':
+            kernel = optarg;
+            if (!setLineKernel(optarg)) {
+                fprintf(stderr, "Kernel %s isn't available here\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(stderr);
+            return 1;
+        }
+    }
+
+    if (fuzzCount)
+        return fuzz(fuzzCount, corpus.seed, !kernel) ? 0 : 1;
+    if (worst)
+        return worstCase(corpus, flags, jobs, iterations, baseline, record, tolerance) ? 0 : 1;
+
+    for (unsigned int format = Unified; format <= Normal; format <<= 1) {
+        if (!(formats & format))
+            continue;
+        bench(static_cast<Format>(format), true, corpus, flags, jobs, iterations);
+        bench(static_cast<Format>(format), false, corpus, flags, jobs, iterations);
+    }
+    return 0;
+}
+#endif
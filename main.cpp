@@ -1,11 +1,18 @@
+#include "Compression.h"
+#include "Git.h"
+#include "Hunk.h"
+#include "PatternFile.h"
+#include "Server.h"
+#include <fcntl.h>
 #include <getopt.h>
-#include <string>
+#include <deque>
+#include <memory>
 #include <vector>
-#include <assert.h>
-#include <regex.h>
+#include <errno.h>
 #include <stdio.h>
-#include <string.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 static void usage(FILE *f)
 {
@@ -15,178 +22,38 @@ static void usage(FILE *f)
             "  --match-raw|-r        Don't treat patterns as regexps\n"
             "  --match-context|-c    Apply matches to context lines\n"
             "  --match-headers|-H    Apply matches to header lines\n"
+            "  --files|-F            Keep or drop whole file sections by matching only their path lines\n"
             "  --verbose|-v          Be verbose\n"
+            "  --jobs|-j [count]     Decide on hunks using count threads\n"
+            "  --buffer-size|-b [n]  Write output in chunks of n bytes, k/m/g suffixes allowed (default 1m)\n"
+            "  --hunk-memory|-M [n]  Decide on hunks bigger than n bytes while reading them\n"
+            "  --compress|-z [type]  Compress the output with gzip or zstd\n"
+            "  --index|-x[=text]     Write a record per hunk with its file, offset, length, outcome and pattern\n"
+            "                        instead of the hunks\n"
+            "  --stats|-s[=json]     Print per pattern counts and timings to stderr at exit\n"
+            "  --server|-l [socket]  Filter for clients connecting to socket\n"
+            "  --client|-C [socket]  Have the server on socket do the filtering\n"
+            "  --set|-n [name]       Name of the server side pattern set to use or define\n"
             "  --in|-i [match]       Keep hunks that match this pattern\n"
-            "  --out|-o|-d [match]   Filter out hunks match this pattern\n");
-}
-
-enum Flag {
-    MatchContext = 0x1,
-    MatchHeaders = 0x2,
-    Raw = 0x4,
-    Verbose = 0x8
-};
-
-class Match
-{
-public:
-    enum Type {
-        In,
-        Out
-    };
-
-    Match(Type t)
-        : type(t)
-    {}
-
-    virtual ~Match()
-    {}
-
-    virtual bool match(const char *line) const = 0;
-    virtual std::string toString() const = 0;
-
-    const Type type;
-};
-
-class RawMatch : public Match
-{
-public:
-    RawMatch(Type type, char *pattern)
-        : Match(type), mPattern(pattern)
-    {}
-
-    virtual bool match(const char *line) const
-    {
-        return strstr(mPattern, line);
-    }
-
-    virtual std::string toString() const
-    {
-        char buf[1024];
-        snprintf(buf, sizeof(buf), "--%s=%s", type == In ? "in" : "out", mPattern);
-        return buf;
-    }
-
-    char *mPattern;
-};
-
-class RegexpMatch : public Match
-{
-public:
-    RegexpMatch(Type type, char *pattern)
-        : Match(type), mPattern(pattern)
-    {
-        if (regcomp(&mRegex, pattern, 0)) {
-            fprintf(stderr, "Invalid regexp %s\n", pattern);
-            exit(3);
-        }
-    }
-
-    ~RegexpMatch()
-    {
-        regfree(&mRegex);
-    }
-
-    virtual bool match(const char *line) const
-    {
-        return !regexec(&mRegex, line, 0, 0, 0);
-    }
-
-    virtual std::string toString() const
-    {
-        char buf[1024];
-        snprintf(buf, sizeof(buf), "--%s=%s", type == In ? "in" : "out", mPattern);
-        return buf;
-    }
-
-    regex_t mRegex;
-    char *mPattern;
-};
-
-static inline void processHunk(const std::vector<std::pair<std::string, bool> > &lines,
-                               const std::vector<Match*> &matches,
-                               unsigned int flags)
-{
-    std::vector<bool> matched;
-    size_t match = matches.size();
-    bool hasIns = false;
-    if (flags & Verbose) {
-        fprintf(stderr, "Parsing hunk\n");
-        for (std::vector<std::pair<std::string, bool> >::const_iterator it = lines.begin(); it != lines.end(); ++it) {
-            fprintf(stderr, "%s %s", it->second ? "t" : "nil", it->first.c_str());
-        }
-    }
-    for (std::vector<std::pair<std::string, bool> >::const_iterator it = lines.begin(); it != lines.end(); ++it) {
-        if (it->second) {
-            for (size_t m=0; m<match; ++m) {
-                if (matches.at(m)->type == Match::In)
-                    hasIns = true;
-                if (matches.at(m)->match(it->first.c_str())) {
-                    if (flags & Verbose)
-                        fprintf(stderr, "Matched %s %s", matches.at(m)->toString().c_str(), it->first.c_str());
-                    match = m;
-                    break;
-                }
-            }
-        }
-    }
-    if (hasIns && match == matches.size()) {
-        if (flags & Verbose)
-            fprintf(stderr, "Hunk was discarded because of no matches\n");
-        return;
-    } else if (match < matches.size() && matches.at(match)->type == Match::Out) {
-        if (flags & Verbose)
-            fprintf(stderr, "Hunk was discarded because of match %zu\n", match);
-        return;
-    }
-    if (flags & Verbose)
-        fprintf(stderr, "Hunk matched. printing %zu lines\n", lines.size());
-
-    for (std::vector<std::pair<std::string, bool> >::const_iterator it = lines.begin(); it != lines.end(); ++it) {
-        fwrite(it->first.c_str(), it->first.size(), 1, stdout);
-    }
-}
-
-static void processFile(FILE *f, const std::vector<Match*> &matches, unsigned int flags)
-{
-    assert(f);
-    char buf[16384];
-    std::vector<std::pair<std::string, bool> > pending;
-    bool seenHunkStart = false;
-    while (fgets(buf, sizeof(buf), f)) {
-        if (!strncmp("--- ", buf, 4) || isdigit(buf[0])) {
-            if (seenHunkStart) {
-                processHunk(pending, matches, flags);
-                pending.clear();
-            }
-            seenHunkStart = true;
-            pending.push_back(std::make_pair(buf, flags & MatchHeaders));
-        } else if (strncmp("+++ ", buf, 4) && strncmp("@@ ", buf, 3)) {
-            switch (buf[0]) {
-            case '+':
-            case '>':
-            case '-':
-            case '<':
-                pending.push_back(std::make_pair(buf, true));
-                break;
-            case ' ':
-                pending.push_back(std::make_pair(buf, flags & MatchContext));
-                break;
-            default:
-                if (seenHunkStart) {
-                    processHunk(pending, matches, flags);
-                    pending.clear();
-                    seenHunkStart = false;
-                }
-
-                pending.push_back(std::make_pair(buf, flags & MatchHeaders));
-                break;
-            }
-        } else {
-            pending.push_back(std::make_pair(buf, flags & MatchHeaders));
-        }
-    }
-    processHunk(pending, matches, flags);
+            "  --out|-o|-d [match]   Filter out hunks match this pattern\n"
+            "  --where|-w [condition]\n"
+            "                        Only keep hunks that also meet condition: added, removed, changed\n"
+            "                        or size compared to a number (added>10, size<=4k), whitespace or\n"
+            "                        !whitespace for whitespace only changes, path~regexp or path!~regexp\n"
+            "  --group|-G [file]     Write the hunks kept by the patterns that follow to file instead of\n"
+            "                        stdout, can be given any number of times\n"
+            "  --patterns|-p [file]  Read patterns from file, one per line prefixed with + (in) or - (out)\n"
+            "  --pattern-cache|-P [file]\n"
+            "                        Keep the compiled patterns in file and reuse them if they're unchanged,\n"
+            "                        for regexps that only saves checking them, they're still compiled\n"
+            "  --line-cache|-L [n]   Remember which pattern matched each line in n bytes of memory, for\n"
+            "                        diffs that repeat lines, k/m/g suffixes allowed\n"
+            "  --decision-cache|-D [file]\n"
+            "                        Remember what was decided about each hunk in file and only evaluate\n"
+            "                        hunks that aren't in it\n"
+            "  --git|-g [args...]    Filter the output of git diff args..., has to be the last option.\n"
+            "                        With --files only paths that could be kept are diffed, their\n"
+            "                        names have to come after --\n");
 }
 
 int main(int argc, char **argv)
@@ -196,16 +63,59 @@ int main(int argc, char **argv)
         { "match-raw", no_argument, 0, 'r' },
         { "match-context", no_argument, 0, 'c' },
         { "match-headers", no_argument, 0, 'H' },
+        { "files", no_argument, 0, 'F' },
         { "in", required_argument, 0, 'i' },
         { "out", required_argument, 0, 'o' },
         { "verbose", no_argument, 0, 'v' },
+        { "jobs", required_argument, 0, 'j' },
+        { "buffer-size", required_argument, 0, 'b' },
+        { "hunk-memory", required_argument, 0, 'M' },
+        { "compress", required_argument, 0, 'z' },
+        { "index", optional_argument, 0, 'x' },
+        { "stats", optional_argument, 0, 's' },
+        { "server", required_argument, 0, 'l' },
+        { "client", required_argument, 0, 'C' },
+        { "set", required_argument, 0, 'n' },
+        { "where", required_argument, 0, 'w' },
+        { "group", required_argument, 0, 'G' },
+        { "patterns", required_argument, 0, 'p' },
+        { "pattern-cache", required_argument, 0, 'P' },
+        { "line-cache", required_argument, 0, 'L' },
+        { "decision-cache", required_argument, 0, 'D' },
         { 0, 0, 0, 0 }
     };
     unsigned int flags = 0;
+    unsigned long jobs = 1;
+    enum { DefaultBufferSize = 1024 * 1024 };
+    size_t bufferSize = DefaultBufferSize;
+    size_t hunkMemory = 0;
+    size_t lineCache = 0;
+    bool stats = false, statsJson = false;
+    Compression compression = Uncompressed;
+    const char *server = 0, *client = 0, *setName = 0, *patternCache = 0, *decisionCache = 0;
+    std::deque<std::string> patternStorage;
     std::vector<std::pair<char*, bool> > input;
     std::vector<Match*> matches;
+    Predicates predicates;
+    // The group of each pattern in input, 0 for stdout and then one per
+    // --group file
+    std::vector<size_t> patternGroups;
+    std::vector<const char *> groupFiles;
+    // Everything after --git goes to git, options included
+    char **gitArgs = 0;
+    int gitCount = 0;
+    for (int i=1; i<argc; ++i) {
+        if (!strcmp(argv[i], "--git") || !strcmp(argv[i], "-g")) {
+            gitArgs = argv + i + 1;
+            gitCount = argc - i - 1;
+            argc = i;
+            break;
+        }
+        if (!strcmp(argv[i], "--"))
+            break;
+    }
     while (true) {
-        const int c = getopt_long(argc, argv, "hri:o:d:cHv", opts, 0);
+        const int c = getopt_long(argc, argv, "hri:o:d:cHFvj:b:M:z:x::s::l:C:n:w:G:p:P:L:D:", opts, 0);
         if (c == -1)
             break;
 
@@ -225,45 +135,284 @@ int main(int argc, char **argv)
         case 'H':
             flags |= MatchHeaders;
             break;
+        case 'F':
+            flags |= Files;
+            break;
         case 'i':
             input.push_back(std::make_pair(optarg, true));
+            patternGroups.push_back(groupFiles.size());
             break;
         case 'o':
         case 'd':
             input.push_back(std::make_pair(optarg, false));
+            patternGroups.push_back(groupFiles.size());
+            break;
+        case 'G':
+            groupFiles.push_back(optarg);
+            break;
+        case 'j': {
+            char *end;
+            jobs = strtoul(optarg, &end, 10);
+            if (*end || !jobs) {
+                fprintf(stderr, "Invalid job count %s\n", optarg);
+                return 1;
+            }
+            break; }
+        case 'b':
+            if (!parseSize(optarg, &bufferSize) || !bufferSize) {
+                fprintf(stderr, "Invalid buffer size %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'M':
+            if (!parseSize(optarg, &hunkMemory)) {
+                fprintf(stderr, "Invalid hunk memory %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'z':
+            if (!parseCompression(optarg, &compression)) {
+                fprintf(stderr, "Invalid compression %s\n", optarg);
+                return 1;
+            }
+            if (!compressionSupported(compression)) {
+                fprintf(stderr, "Built without %s support\n", optarg);
+                return 1;
+            }
+            break;
+        case 'x':
+            flags |= Index;
+            if (optarg) {
+                if (strcmp(optarg, "text")) {
+                    fprintf(stderr, "Invalid index format %s\n", optarg);
+                    return 1;
+                }
+                flags |= TextIndex;
+            }
+            break;
+        case 's':
+            stats = true;
+            if (optarg) {
+                if (strcmp(optarg, "json")) {
+                    fprintf(stderr, "Invalid stats format %s\n", optarg);
+                    return 1;
+                }
+                statsJson = true;
+            }
+            break;
+        case 'l':
+            server = optarg;
+            break;
+        case 'C':
+            client = optarg;
+            break;
+        case 'n':
+            setName = optarg;
+            break;
+        case 'w':
+            if (!predicates.add(optarg))
+                return 1;
+            break;
+        case 'p':
+            if (!readPatternFile(optarg, patternStorage, input))
+                return 2;
+            patternGroups.resize(input.size(), groupFiles.size());
+            break;
+        case 'P':
+            patternCache = optarg;
+            break;
+        case 'L':
+            if (!parseSize(optarg, &lineCache) || !lineCache) {
+                fprintf(stderr, "Invalid line cache size %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'D':
+            decisionCache = optarg;
             break;
         default:
             usage(stderr);
             return 1;
         }
     }
-    if (input.empty()) {
+    if (!groupFiles.empty() && (flags & Index)) {
+        fprintf(stderr, "--group can't be used with --index\n");
+        return 1;
+    }
+    if (server || client) {
+        // The server only knows about pattern sets and their flags, any
+        // other option would be ignored
+        if (!predicates.empty() || !groupFiles.empty() || (flags & (Verbose | Index)) || stats || jobs != 1
+            || bufferSize != DefaultBufferSize || hunkMemory || compression != Uncompressed || patternCache
+            || lineCache || decisionCache || gitArgs) {
+            fprintf(stderr, "Only patterns, --match-*, --files and --set work with --server or --client\n");
+            return 1;
+        }
+        PatternSet set;
+        set.flags = flags & (MatchContext | MatchHeaders | Raw | Files);
+        for (std::vector<std::pair<char*, bool> >::const_iterator it = input.begin(); it != input.end(); ++it)
+            set.patterns.push_back(std::string(it->second ? "+" : "-") + it->first);
+        if (server)
+            return runServer(server, set);
+        const std::string name = setName ? setName : (set.patterns.empty() ? "default" : set.hashName());
+        return runClient(client, name, set, argv + optind, argc - optind);
+    }
+    if ((flags & Files) && predicates.needsLines()) {
+        fprintf(stderr, "Only path conditions work with --files\n");
+        return 1;
+    }
+    if (input.empty() && predicates.empty()) {
         fprintf(stderr, "No matches\n");
         return 4;
     }
 
+    // A cache hit also means every regexp has been compiled successfully
+    // before, so they only get compiled again if they're needed on their own.
+    std::string compiled;
+    const bool cached = patternCache && readPatternCache(patternCache, input, flags & Raw, compiled);
     for (std::vector<std::pair<char*, bool> >::const_iterator it = input.begin(); it != input.end(); ++it) {
         const Match::Type type = it->second ? Match::In : Match::Out;
-        matches.push_back(flags & Raw
-                          ? static_cast<Match*>(new RawMatch(type, it->first)) :
-                          static_cast<Match*>(new RegexpMatch(type, it->first)));
+        if (flags & Raw) {
+            matches.push_back(new RawMatch(type, it->first));
+            continue;
+        }
+        RegexpMatch *match = new RegexpMatch(type, it->first, cached);
+        matches.push_back(match);
+        if (!match->isValid()) {
+            fprintf(stderr, "Invalid regexp %s\n", it->first);
+            return 3;
+        }
     }
 
-    if (optind == argc) {
-        processFile(stdin, matches, flags);
+    const MatchSet matchSet(matches, flags, cached ? &compiled : 0, groupFiles.empty() ? 0 : &patternGroups);
+    if (patternCache && !cached) {
+        compiled.clear();
+        matchSet.save(compiled);
+        if (!writePatternCache(patternCache, input, flags & Raw, compiled))
+            fprintf(stderr, "Can't write pattern cache %s\n", patternCache);
+    }
+    std::unique_ptr<Stats> statsData(stats ? new Stats(matches.size()) : 0);
+    FilterOptions options(matchSet, flags);
+    options.hunkMemory = hunkMemory;
+    options.stats = statsData.get();
+    options.predicates = predicates.empty() ? 0 : &predicates;
+    std::unique_ptr<LineCache> lines(lineCache ? new LineCache(lineCache) : 0);
+    options.lines = lines.get();
+    std::unique_ptr<DecisionCache> decisions;
+    if (decisionCache) {
+        const unsigned long long decisionKey = patternKey(input, flags & (MatchContext | MatchHeaders | Raw | Files));
+        // Groups change which pattern a hunk is put down to
+        const unsigned long long groupKey = patternGroups.empty() || groupFiles.empty() ? decisionKey
+            : fnv1a(&patternGroups[0], patternGroups.size() * sizeof(size_t), decisionKey);
+        decisions.reset(new DecisionCache(predicates.key(groupKey)));
+        if (!decisions->load(decisionCache))
+            fprintf(stderr, "Can't read decision cache %s\n", decisionCache);
+        options.decisions = decisions.get();
+    }
+    FdOutput fdOutput(STDOUT_FILENO, bufferSize, statsData.get());
+    std::unique_ptr<CompressedOutput> compressed(compression != Uncompressed ? new CompressedOutput(compression, fdOutput) : 0);
+    Output &output = compressed ? static_cast<Output &>(*compressed) : fdOutput;
+    IndexOutput index(output, flags & TextIndex, matches.size());
+    // Every group gets an output of its own, set up like stdout
+    std::vector<std::unique_ptr<FdOutput> > groupFds;
+    std::vector<std::unique_ptr<CompressedOutput> > groupCompressed;
+    std::vector<Output*> groupOutputs;
+    std::vector<int> groupFdNumbers;
+    for (std::vector<const char *>::const_iterator it = groupFiles.begin(); it != groupFiles.end(); ++it) {
+        const int fd = open(*it, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1) {
+            fprintf(stderr, "Can't open %s for writing\n", *it);
+            return 2;
+        }
+        groupFdNumbers.push_back(fd);
+        groupFds.push_back(std::unique_ptr<FdOutput>(new FdOutput(fd, bufferSize, statsData.get())));
+        if (compression != Uncompressed) {
+            groupCompressed.push_back(std::unique_ptr<CompressedOutput>(new CompressedOutput(compression, *groupFds.back())));
+            groupOutputs.push_back(groupCompressed.back().get());
+        } else {
+            groupOutputs.push_back(groupFds.back().get());
+        }
+    }
+    std::vector<Output*> patternOutputs;
+    for (std::vector<size_t>::const_iterator it = patternGroups.begin(); it != patternGroups.end(); ++it)
+        patternOutputs.push_back(*it ? groupOutputs[*it - 1] : &output);
+    SplitOutput split(output, patternOutputs);
+    Output &kept = flags & Index ? static_cast<Output &>(index) : groupFiles.empty() ? output : split;
+    // Verbose output is per hunk and would interleave across threads
+    if (flags & Verbose)
+        jobs = 1;
+    if (jobs > 1 && argc - optind > 1 && !gitArgs && groupFiles.empty()) {
+        if (!processPaths(argv + optind, argc - optind, options, jobs, output))
+            return 2;
     } else {
-        while (optind < argc) {
-            FILE *f = fopen(argv[optind++], "r");
-            if (!f) {
-                fprintf(stderr, "Can't open %s for reading\n", argv[optind - 1]);
+        std::unique_ptr<HunkHandler> handler;
+        if (jobs > 1) {
+            handler.reset(new ParallelFilter(options, jobs, kept));
+        } else {
+            handler.reset(new SerialFilter(options, kept));
+        }
+        std::string error;
+        if (gitArgs) {
+            if (optind != argc) {
+                fprintf(stderr, "Files can't be combined with --git\n");
+                return 1;
+            }
+            if (!processGit(gitArgs, gitCount, *handler, options, &error)) {
+                fprintf(stderr, "Can't read git diff: %s\n", error.c_str());
                 return 2;
             }
-            processFile(f, matches, flags);
-            fclose(f);
+        } else if (optind == argc) {
+            if (!processFile(STDIN_FILENO, *handler, options, &error)) {
+                fprintf(stderr, "Can't read stdin: %s\n", error.c_str());
+                return 2;
+            }
+        } else {
+            for (int file = 0; optind < argc; ++file) {
+                if (flags & Index) {
+                    handler->sync();
+                    index.setFile(file);
+                }
+                if (!processPath(argv[optind++], *handler, options, &error)) {
+                    fprintf(stderr, "%s\n", error.c_str());
+                    return 2;
+                }
+            }
+        }
+    }
+    if (compressed)
+        compressed->finish();
+    // A full disk or a closed pipe only shows up here
+    fdOutput.flush();
+    bool written = true;
+    if (fdOutput.error()) {
+        fprintf(stderr, "Can't write output: %s\n", strerror(fdOutput.error()));
+        written = false;
+    }
+    for (size_t i=0; i<groupFds.size(); ++i) {
+        if (i < groupCompressed.size())
+            groupCompressed[i]->finish();
+        groupFds[i]->flush();
+        int error = groupFds[i]->error();
+        if (close(groupFdNumbers[i]) && !error)
+            error = errno;
+        if (error) {
+            fprintf(stderr, "Can't write %s: %s\n", groupFiles[i], strerror(error));
+            written = false;
         }
     }
+    if (decisions && !decisions->save(decisionCache))
+        fprintf(stderr, "Can't write decision cache %s\n", decisionCache);
+    if (statsData) {
+        fdOutput.flush();
+        if (lines)
+            statsData->lineCache(lines->lookups(), lines->hits());
+        std::vector<std::string> names;
+        for (std::vector<Match*>::const_iterator it = matches.begin(); it != matches.end(); ++it)
+            names.push_back((*it)->toString());
+        statsData->print(stderr, names, statsJson);
+    }
     for (std::vector<Match*>::const_iterator it = matches.begin(); it != matches.end(); ++it) {
         delete *it;
     }
-    return 0;
+    return written ? 0 : 2;
 }